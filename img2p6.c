@@ -0,0 +1,2258 @@
+/*
+ * img2p6.c
+ * 画像を PC-6001 (初代) SCREEN 3/4 の VRAM形式に変換するライブラリ
+ * （使い方は img2p6.h、変換方法と符号化の形式は README 参照）
+ *
+ * 減色はRGBの差の少ない最近傍選択
+ * 横長2ドットの平均値を使用（偶数ドット参照のほうがよい？）
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "img2p6.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* 最近傍色テーブル: RGB 各上位5ビットで引く 32x32x32 の立方体 */
+#define LUT_BITS        5
+#define LUT_DIM         (1 << LUT_BITS)
+#define LUT_SHIFT       (8 - LUT_BITS)
+#define LUT_AMBIGUOUS   0xff    /* セル内で最近傍色が一意でない */
+
+/* 誤差拡散の1ラインの最大ドット数 */
+#define FS_MAX_DOTS     P6_XSIZE
+
+/* ランレングス符号化のリテラル・繰り返しの最大長 */
+#define RLE_MAX_LITERAL 127
+#define RLE_MIN_RUN     3
+#define RLE_MAX_RUN     (0x7f + 2)
+
+/* 差分符号化でこのバイト数以下の変化しない隙間は前後の変化とまとめる */
+#define DELTA_MERGE_GAP 3
+
+/* LZ のリテラル・一致の長さ */
+#define LZ_MAX_LITERAL  127
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (0x7f + LZ_MIN_MATCH)
+
+/* LZ 一致検索のハッシュチェーン（ハッシュの大きさは img2p6.h） */
+#define LZ_MAX_CHAIN    64
+#define LZ_NIL          0xffff
+
+/*
+ * LZ 展開ルーチン（README 参照）の 4MHz Z80 での所要Tステート
+ * リテラル・一致とも1バイトのコピーは LDIR の 21Tステート
+ */
+#define LZ_LITERAL_T    50
+#define LZ_MATCH_T      153
+#define LZ_COPY_T       21
+
+/* 固定の4色パレット（PC-6001 SCREEN 3） */
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+} palrgb_t;
+
+typedef struct {
+    palrgb_t colors[4];
+} p6palette_t;
+
+static const p6palette_t p6palette[2] = {
+    {
+        {
+            { .r =   0, .g = 255, .b =   0 }, // 緑
+            { .r = 255, .g = 255, .b =   0 }, // 黄
+            { .r =   0, .g =   0, .b = 255 }, // 青
+            { .r = 255, .g =   0, .b =   0 }, // 赤
+        }
+    },
+    {
+        {
+            { .r = 255, .g = 255, .b = 255 }, // 白
+            { .r =   0, .g = 255, .b = 255 }, // シアン
+            { .r = 255, .g =   0, .b = 255 }, // マゼンタ
+            { .r = 255, .g = 128, .b =   0 }, // 橙
+        }
+    }
+};
+
+/*
+ * 最近傍色テーブル
+ * 各セル内の全ての色の最近傍色が同じ場合はそのインデックス、
+ * そうでない場合は LUT_AMBIGUOUS を入れておき、そのときだけ総当たりで求める
+ */
+typedef struct {
+    const p6palette_t *palette;
+    uint8_t cube[LUT_DIM * LUT_DIM * LUT_DIM];
+    /*
+     * SIMD版用の係数
+     * 距離の大小比較は 2 * (R*Pr + G*Pg + B*Pb) - |P|^2 の大小比較と等価
+     */
+    uint32_t rg_weight[4];      /* (Pg << 16) | Pr */
+    uint32_t b_weight[4];       /* Pb */
+    int32_t norm[4];            /* Pr^2 + Pg^2 + Pb^2 */
+} colorlut_t;
+
+static colorlut_t color_luts[2];
+
+/*
+ * 組織的ディザ用のしきい値表
+ * 位置 (x, y) の Bayer 行列要素 M (0 ... n*n-1) から d = (2M+1)*128/(n*n) - 128 を求め、
+ * SCREEN 3 は横2ドット平均後の RGB 各成分に d を加えて 0 ... 255 に飽和させてから
+ * 最近傍色を選び、SCREEN 4 は gray + d > 127 つまり Y >= (128 - d) * 1000 で2値化する
+ * 変換カーネルの1回分（SCREEN 3 は 16ドット、SCREEN 4 は 32ドット）は行列の幅で
+ * 割り切れるので、ライン毎にその分の表を作っておけば位置による分岐は要らない
+ * ディザなしは d = 0 の 1x1 行列として扱う
+ */
+#define ORDERED_MAX     8
+#define ORDERED_DOTS3   16
+#define ORDERED_DOTS4   32
+
+typedef struct {
+    int size;                                           /* 行列の大きさ */
+    int16_t bias[ORDERED_MAX][ORDERED_DOTS3];           /* SCREEN 3 各成分に加える値 */
+    int32_t threshold[ORDERED_MAX][ORDERED_DOTS4];      /* SCREEN 4: Y がこれより大きければ 1 */
+    uint8_t gray_threshold[ORDERED_MAX][ORDERED_DOTS4]; /* 同じくグレースケール画像の値 */
+} ordered_t;
+
+static ordered_t ordered_maps[3];       /* なし、4x4、8x8 */
+
+/* 1ライン分の変換関数（SIMD版は実行時にCPUを見て選択する） */
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    /* src のライン先頭から nbytes バイト分のVRAMデータを dst に作る */
+    /* bias, threshold はそのラインの ordered_t の表 */
+    void (*pack3_row)(const uint8_t *src, int nbytes, const colorlut_t *lut,
+      const int16_t *bias, uint8_t *dst);
+    void (*pack4_row)(const uint8_t *src, int nbytes, const int32_t *threshold,
+      uint8_t *dst);
+    /* SCREEN 4 の元画像がグレースケール（1ドット1バイト）の場合 */
+    void (*pack4g_row)(const uint8_t *src, int nbytes,
+      const uint8_t *threshold, uint8_t *dst);
+    /* SCREEN 3 の元画像が横半分の場合（平均せずに元画像1ドットを1ドットにする） */
+    void (*pack3n_row)(const uint8_t *src, int nbytes, const colorlut_t *lut,
+      const int16_t *bias, uint8_t *dst);
+    /* --fit の縦方向: acc[i] += weight * src[i] */
+    void (*scale_accum)(int32_t *acc, const uint16_t *src, int n, int weight);
+} kernel_t;
+
+static const kernel_t *kernel;
+
+/* 最近傍色インデックスを求める */
+static unsigned int
+nearest_color(const p6palette_t *palette, uint8_t r, uint8_t g, uint8_t b)
+{
+    unsigned int min_dist = UINT_MAX;
+    unsigned int index = 0;
+    unsigned int i;
+    for (i = 0; i < 4; ++i) {
+        int dr = (int)r - (int)palette->colors[i].r;
+        int dg = (int)g - (int)palette->colors[i].g;
+        int db = (int)b - (int)palette->colors[i].b;
+        unsigned int dist = (dr * dr) + (dg * dg) + (db * db);
+        if (dist < min_dist) {
+            min_dist = dist;
+            index = i;
+        }
+    }
+    return index;
+}
+
+/*
+ * 最近傍色テーブルを作る
+ * 同じ最近傍色になる領域は凸なので、セルの8頂点が全て同じ色になれば
+ * セル内の全ての色もその色になる
+ */
+static void
+build_color_lut(colorlut_t *lut, const p6palette_t *palette)
+{
+    const unsigned int cell = 1U << LUT_SHIFT;
+    unsigned int r, g, b, corner;
+
+    lut->palette = palette;
+    for (corner = 0; corner < 4; corner++) {
+        const palrgb_t *p = &palette->colors[corner];
+        lut->rg_weight[corner] = ((uint32_t)p->g << 16) | p->r;
+        lut->b_weight[corner] = p->b;
+        lut->norm[corner] = p->r * p->r + p->g * p->g + p->b * p->b;
+    }
+    for (r = 0; r < LUT_DIM; r++) {
+        for (g = 0; g < LUT_DIM; g++) {
+            for (b = 0; b < LUT_DIM; b++) {
+                unsigned int r0 = r << LUT_SHIFT;
+                unsigned int g0 = g << LUT_SHIFT;
+                unsigned int b0 = b << LUT_SHIFT;
+                unsigned int index = nearest_color(palette, r0, g0, b0);
+                for (corner = 1; corner < 8; corner++) {
+                    unsigned int cr = r0 + ((corner & 4) ? cell - 1 : 0);
+                    unsigned int cg = g0 + ((corner & 2) ? cell - 1 : 0);
+                    unsigned int cb = b0 + ((corner & 1) ? cell - 1 : 0);
+                    if (nearest_color(palette, cr, cg, cb) != index) {
+                        index = LUT_AMBIGUOUS;
+                        break;
+                    }
+                }
+                lut->cube[(r << (LUT_BITS * 2)) | (g << LUT_BITS) | b] = index;
+            }
+        }
+    }
+}
+
+static void
+init_color_luts(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        build_color_lut(&color_luts[i], &p6palette[i]);
+}
+
+static void
+build_ordered_map(ordered_t *map, int size)
+{
+    /* M(2n) = [4M(n), 4M(n)+2; 4M(n)+3, 4M(n)+1] */
+    static const int quad[2][2] = { { 0, 2 }, { 3, 1 } };
+    int m[ORDERED_MAX][ORDERED_MAX];
+    int s, x, y;
+
+    m[0][0] = 0;
+    for (s = 1; s < size; s *= 2) {
+        for (y = s * 2 - 1; y >= 0; y--) {
+            for (x = s * 2 - 1; x >= 0; x--)
+                m[y][x] = m[y % s][x % s] * 4 + quad[y / s][x / s];
+        }
+    }
+    map->size = size;
+    for (y = 0; y < size; y++) {
+        for (x = 0; x < ORDERED_DOTS4; x++) {
+            int d = (size == 1) ? 0 :
+              (2 * m[y][x % size] + 1) * 128 / (size * size) - 128;
+            if (x < ORDERED_DOTS3)
+                map->bias[y][x] = d;
+            map->threshold[y][x] = (128 - d) * 1000 - 1;
+            /* グレースケール画像の値 v は Y = 1000 * v なので v > 127 - d と同じ */
+            map->gray_threshold[y][x] = 127 - d;
+        }
+    }
+}
+
+static void
+init_ordered_maps(void)
+{
+
+    build_ordered_map(&ordered_maps[0], 1);
+    build_ordered_map(&ordered_maps[1], 4);
+    build_ordered_map(&ordered_maps[2], 8);
+}
+
+/* 減色・2値化の方式に対応するしきい値表 */
+static const ordered_t *
+ordered_map(int dither)
+{
+
+    switch (dither) {
+    case P6_DITHER_BAYER4:
+        return &ordered_maps[1];
+    case P6_DITHER_BAYER8:
+        return &ordered_maps[2];
+    default:
+        return &ordered_maps[0];
+    }
+}
+
+/* テーブルを使って最近傍色インデックスを求める */
+static inline unsigned int
+lut_nearest_color(const colorlut_t *lut, uint8_t r, uint8_t g, uint8_t b)
+{
+    unsigned int index;
+
+    index = lut->cube[((r >> LUT_SHIFT) << (LUT_BITS * 2)) |
+      ((g >> LUT_SHIFT) << LUT_BITS) | (b >> LUT_SHIFT)];
+    if (index == LUT_AMBIGUOUS)
+        index = nearest_color(lut->palette, r, g, b);
+    return index;
+}
+
+static inline int
+rgb_to_gray(int r, int g, int b)
+{
+
+    return (299 * r + 587 * g + 114 * b) / 1000;
+}
+
+static inline int
+clamp255(int v)
+{
+
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * SIMD版の2値化しきい値
+ * rgb_to_gray() > 127 は 299 * R + 587 * G + 114 * B >= 128000 と等価
+ */
+#define GRAY_WEIGHT_R   299
+#define GRAY_WEIGHT_G   587
+#define GRAY_WEIGHT_B   114
+#define GRAY_THRESHOLD  (128 * 1000)
+
+/* SCREEN 3 1ライン分: 元画像横2ドットの平均色を4ドットずつ1バイトに詰める */
+static void
+pack3_row_scalar(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    int i, x_byte;
+
+    for (x_byte = 0; x_byte < nbytes; x_byte++) {
+        uint8_t out_byte = 0;
+        for (i = 0; i < 4; ++i) {
+            /* 2ドットを1ドットに平均化 */
+            int x = (x_byte * 4 + i) * 2;
+            int idx1 = x * 3;
+            int idx2 = (x + 1) * 3;
+            int d = bias[(x_byte * 4 + i) % ORDERED_DOTS3];
+            uint8_t r = clamp255((src[idx1 + 0] + src[idx2 + 0]) / 2 + d);
+            uint8_t g = clamp255((src[idx1 + 1] + src[idx2 + 1]) / 2 + d);
+            uint8_t b = clamp255((src[idx1 + 2] + src[idx2 + 2]) / 2 + d);
+            unsigned int color = lut_nearest_color(lut, r, g, b);
+            out_byte |= (color & 0x03U) << ((3 - i) * 2);
+        }
+        dst[x_byte] = out_byte;
+    }
+}
+
+/*
+ * SCREEN 3 1ライン分（横半分の元画像）: 元画像1ドットをそのまま4ドットずつ1バイトに詰める
+ * 横2倍に拡大してから平均した場合と同じ結果になる
+ */
+static void
+pack3n_row_scalar(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    int i, x_byte;
+
+    for (x_byte = 0; x_byte < nbytes; x_byte++) {
+        uint8_t out_byte = 0;
+        for (i = 0; i < 4; ++i) {
+            int x = x_byte * 4 + i;
+            int idx = x * 3;
+            int d = bias[x % ORDERED_DOTS3];
+            uint8_t r = clamp255(src[idx + 0] + d);
+            uint8_t g = clamp255(src[idx + 1] + d);
+            uint8_t b = clamp255(src[idx + 2] + d);
+            unsigned int color = lut_nearest_color(lut, r, g, b);
+            out_byte |= (color & 0x03U) << ((3 - i) * 2);
+        }
+        dst[x_byte] = out_byte;
+    }
+}
+
+/*
+ * SCREEN 4 1ライン分: グレースケール化して2値化し 8ドットずつ1バイトに詰める
+ * rgb_to_gray() の割り算を省いて 1000倍の輝度のまましきい値と比べる
+ */
+static void
+pack4_row_scalar(const uint8_t *src, int nbytes, const int32_t *threshold,
+  uint8_t *dst)
+{
+    int x_byte;
+
+    for (x_byte = 0; x_byte < nbytes; x_byte++) {
+        uint8_t out_byte = 0;
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            int x = x_byte * 8 + bit;
+            int idx = x * 3;
+            uint8_t r = src[idx + 0];
+            uint8_t g = src[idx + 1];
+            uint8_t b = src[idx + 2];
+            int y = GRAY_WEIGHT_R * r + GRAY_WEIGHT_G * g + GRAY_WEIGHT_B * b;
+            if (y > threshold[x % ORDERED_DOTS4]) {
+                out_byte |= 0x80U >> bit;
+            }
+        }
+        dst[x_byte] = out_byte;
+    }
+}
+
+/* SCREEN 4 1ライン分（グレースケール画像）: しきい値より大きいドットを 1 にする */
+static void
+pack4g_row_scalar(const uint8_t *src, int nbytes, const uint8_t *threshold,
+  uint8_t *dst)
+{
+    int x_byte;
+
+    for (x_byte = 0; x_byte < nbytes; x_byte++) {
+        uint8_t out_byte = 0;
+        int bit;
+        for (bit = 0; bit < 8; bit++) {
+            int x = x_byte * 8 + bit;
+            if (src[x] > threshold[x % ORDERED_DOTS4])
+                out_byte |= 0x80U >> bit;
+        }
+        dst[x_byte] = out_byte;
+    }
+}
+
+static void
+scale_accum_scalar(int32_t *acc, const uint16_t *src, int n, int weight)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        acc[i] += weight * src[i];
+}
+
+static int
+cpu_has_scalar(void)
+{
+
+    return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * 32ドット分の RGB (96バイト) を R, G, B 各16バイト x 2 に並べ替える
+ * 3バイト周期の並びは unpack を5段重ねると元に戻る
+ */
+__attribute__((target("sse2")))
+static inline void
+deinterleave_rgb32_sse2(const uint8_t *src, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i c0 = _mm_loadu_si128((const __m128i *)(src + 0));
+    __m128i c1 = _mm_loadu_si128((const __m128i *)(src + 16));
+    __m128i c2 = _mm_loadu_si128((const __m128i *)(src + 32));
+    __m128i c3 = _mm_loadu_si128((const __m128i *)(src + 48));
+    __m128i c4 = _mm_loadu_si128((const __m128i *)(src + 64));
+    __m128i c5 = _mm_loadu_si128((const __m128i *)(src + 80));
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        __m128i n0 = _mm_unpacklo_epi8(c0, c3);
+        __m128i n1 = _mm_unpackhi_epi8(c0, c3);
+        __m128i n2 = _mm_unpacklo_epi8(c1, c4);
+        __m128i n3 = _mm_unpackhi_epi8(c1, c4);
+        __m128i n4 = _mm_unpacklo_epi8(c2, c5);
+        __m128i n5 = _mm_unpackhi_epi8(c2, c5);
+        c0 = n0; c1 = n1; c2 = n2; c3 = n3; c4 = n4; c5 = n5;
+    }
+    r[0] = c0; r[1] = c1;
+    g[0] = c2; g[1] = c3;
+    b[0] = c4; b[1] = c5;
+}
+
+/* 16ドット分の隣接2ドットを平均して 16ビット x 8 にする */
+__attribute__((target("sse2")))
+static inline __m128i
+average_pairs_sse2(__m128i v)
+{
+    __m128i even = _mm_and_si128(v, _mm_set1_epi16(0x00ff));
+    __m128i odd = _mm_srli_epi16(v, 8);
+
+    return _mm_srli_epi16(_mm_add_epi16(even, odd), 1);
+}
+
+/* 16ビット x 8 の各ドットにディザの値を加えて 0 ... 255 に飽和させる */
+__attribute__((target("sse2")))
+static inline __m128i
+add_bias_sse2(__m128i v, const int16_t *bias)
+{
+
+    v = _mm_add_epi16(v, _mm_loadu_si128((const __m128i *)bias));
+    return _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()),
+      _mm_set1_epi16(255));
+}
+
+/* 4ドット分の最近傍色インデックス（同距離なら若い番号を選ぶのは総当たりと同じ） */
+__attribute__((target("sse2")))
+static inline __m128i
+nearest4_sse2(__m128i rg, __m128i b0, const colorlut_t *lut)
+{
+    __m128i best = _mm_setzero_si128();
+    __m128i index = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        __m128i dot = _mm_add_epi32(
+          _mm_madd_epi16(rg, _mm_set1_epi32((int32_t)lut->rg_weight[i])),
+          _mm_madd_epi16(b0, _mm_set1_epi32((int32_t)lut->b_weight[i])));
+        __m128i score = _mm_sub_epi32(_mm_slli_epi32(dot, 1),
+          _mm_set1_epi32(lut->norm[i]));
+        if (i == 0) {
+            best = score;
+        } else {
+            __m128i gt = _mm_cmpgt_epi32(score, best);
+            best = _mm_or_si128(_mm_and_si128(gt, score),
+              _mm_andnot_si128(gt, best));
+            index = _mm_or_si128(_mm_and_si128(gt, _mm_set1_epi32(i)),
+              _mm_andnot_si128(gt, index));
+        }
+    }
+    return index;
+}
+
+/* 16ドット分のインデックス (8ビット x 16) を 2ビットずつ 4バイトに詰める */
+__attribute__((target("sse2")))
+static inline uint32_t
+pack2bpp_sse2(__m128i idx)
+{
+    __m128i t, u;
+    uint32_t out;
+
+    /* d0 << 2 | d1 */
+    t = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(idx, _mm_set1_epi16(0x00ff)), 2),
+      _mm_srli_epi16(idx, 8));
+    /* (d0 d1) << 4 | (d2 d3) */
+    u = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(t, _mm_set1_epi32(0xffff)), 4),
+      _mm_srli_epi32(t, 16));
+    u = _mm_packs_epi32(u, u);
+    u = _mm_packus_epi16(u, u);
+    out = (uint32_t)_mm_cvtsi128_si32(u);
+    return out;
+}
+
+__attribute__((target("sse2")))
+static void
+pack3_row_sse2(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x_byte;
+
+    /* 元画像32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        __m128i r[2], g[2], b[2], idx[4];
+        uint32_t out;
+        int h;
+
+        deinterleave_rgb32_sse2(src + x_byte * 4 * 2 * 3, r, g, b);
+        for (h = 0; h < 2; h++) {
+            __m128i ra = add_bias_sse2(average_pairs_sse2(r[h]), bias + h * 8);
+            __m128i ga = add_bias_sse2(average_pairs_sse2(g[h]), bias + h * 8);
+            __m128i ba = add_bias_sse2(average_pairs_sse2(b[h]), bias + h * 8);
+            idx[h * 2 + 0] = nearest4_sse2(_mm_unpacklo_epi16(ra, ga),
+              _mm_unpacklo_epi16(ba, zero), lut);
+            idx[h * 2 + 1] = nearest4_sse2(_mm_unpackhi_epi16(ra, ga),
+              _mm_unpackhi_epi16(ba, zero), lut);
+        }
+        out = pack2bpp_sse2(_mm_packus_epi16(_mm_packs_epi32(idx[0], idx[1]),
+          _mm_packs_epi32(idx[2], idx[3])));
+        memcpy(&dst[x_byte], &out, 4);
+    }
+    if (x_byte < nbytes)
+        pack3_row_scalar(src + x_byte * 4 * 2 * 3, nbytes - x_byte, lut,
+          bias, dst + x_byte);
+}
+
+__attribute__((target("sse2")))
+static void
+pack3n_row_sse2(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x_byte;
+
+    /* 元画像32ドット（出力8バイト）ずつ */
+    for (x_byte = 0; x_byte + 8 <= nbytes; x_byte += 8) {
+        __m128i r[2], g[2], b[2], idx[8];
+        uint32_t out[2];
+        int q;
+
+        deinterleave_rgb32_sse2(src + x_byte * 4 * 3, r, g, b);
+        for (q = 0; q < 4; q++) {
+            /* 8ドットずつ 16ビットに広げる */
+            const int16_t *bq = bias + (q & 1) * 8;
+            __m128i ra = add_bias_sse2((q & 1) ?
+              _mm_unpackhi_epi8(r[q >> 1], zero) :
+              _mm_unpacklo_epi8(r[q >> 1], zero), bq);
+            __m128i ga = add_bias_sse2((q & 1) ?
+              _mm_unpackhi_epi8(g[q >> 1], zero) :
+              _mm_unpacklo_epi8(g[q >> 1], zero), bq);
+            __m128i ba = add_bias_sse2((q & 1) ?
+              _mm_unpackhi_epi8(b[q >> 1], zero) :
+              _mm_unpacklo_epi8(b[q >> 1], zero), bq);
+            idx[q * 2 + 0] = nearest4_sse2(_mm_unpacklo_epi16(ra, ga),
+              _mm_unpacklo_epi16(ba, zero), lut);
+            idx[q * 2 + 1] = nearest4_sse2(_mm_unpackhi_epi16(ra, ga),
+              _mm_unpackhi_epi16(ba, zero), lut);
+        }
+        out[0] = pack2bpp_sse2(_mm_packus_epi16(_mm_packs_epi32(idx[0], idx[1]),
+          _mm_packs_epi32(idx[2], idx[3])));
+        out[1] = pack2bpp_sse2(_mm_packus_epi16(_mm_packs_epi32(idx[4], idx[5]),
+          _mm_packs_epi32(idx[6], idx[7])));
+        memcpy(&dst[x_byte], out, 8);
+    }
+    if (x_byte < nbytes)
+        pack3n_row_scalar(src + x_byte * 4 * 3, nbytes - x_byte, lut,
+          bias, dst + x_byte);
+}
+
+/* 8ドット分の輝度が threshold より大きければ 0xffff、以下なら 0 */
+__attribute__((target("sse2")))
+static inline __m128i
+threshold8_sse2(__m128i r, __m128i g, __m128i b, const int32_t *threshold)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rg_weight = _mm_set1_epi32((GRAY_WEIGHT_G << 16) | GRAY_WEIGHT_R);
+    const __m128i b_weight = _mm_set1_epi32(GRAY_WEIGHT_B);
+    __m128i lo, hi;
+
+    lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), rg_weight),
+      _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), b_weight));
+    hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), rg_weight),
+      _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), b_weight));
+    return _mm_packs_epi32(
+      _mm_cmpgt_epi32(lo, _mm_loadu_si128((const __m128i *)threshold)),
+      _mm_cmpgt_epi32(hi, _mm_loadu_si128((const __m128i *)(threshold + 4))));
+}
+
+/* 16ビット x 8 の並びを逆順にする（先頭ドットを MSB にするため） */
+__attribute__((target("sse2")))
+static inline __m128i
+reverse_epi16_sse2(__m128i v)
+{
+
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+__attribute__((target("sse2")))
+static void
+pack4_row_sse2(const uint8_t *src, int nbytes, const int32_t *threshold,
+  uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x_byte;
+
+    /* 32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        __m128i r[2], g[2], b[2], m[4];
+        uint16_t out[2];
+        int h;
+
+        deinterleave_rgb32_sse2(src + x_byte * 8 * 3, r, g, b);
+        for (h = 0; h < 2; h++) {
+            m[h * 2 + 0] = reverse_epi16_sse2(threshold8_sse2(
+              _mm_unpacklo_epi8(r[h], zero), _mm_unpacklo_epi8(g[h], zero),
+              _mm_unpacklo_epi8(b[h], zero), threshold + h * 16));
+            m[h * 2 + 1] = reverse_epi16_sse2(threshold8_sse2(
+              _mm_unpackhi_epi8(r[h], zero), _mm_unpackhi_epi8(g[h], zero),
+              _mm_unpackhi_epi8(b[h], zero), threshold + h * 16 + 8));
+            out[h] = (uint16_t)_mm_movemask_epi8(
+              _mm_packs_epi16(m[h * 2 + 0], m[h * 2 + 1]));
+        }
+        /* movemask の下位8ビットが先頭の出力バイト */
+        dst[x_byte + 0] = out[0] & 0xff;
+        dst[x_byte + 1] = out[0] >> 8;
+        dst[x_byte + 2] = out[1] & 0xff;
+        dst[x_byte + 3] = out[1] >> 8;
+    }
+    if (x_byte < nbytes)
+        pack4_row_scalar(src + x_byte * 8 * 3, nbytes - x_byte, threshold,
+          dst + x_byte);
+}
+
+/*
+ * movemask は先頭ドットが LSB になるので、SSE2 版はバイト毎にビットの並びを
+ * 逆にする表を引く（AVX2 版は先にバイトの並びを逆にしておく）
+ */
+static uint8_t bit_reverse[256];
+
+static void
+init_bit_reverse(void)
+{
+    int i, bit;
+
+    for (i = 0; i < 256; i++) {
+        uint8_t v = 0;
+        for (bit = 0; bit < 8; bit++) {
+            if (i & (1 << bit))
+                v |= 0x80U >> bit;
+        }
+        bit_reverse[i] = v;
+    }
+}
+
+/* 符号なしの比較は最上位ビットを反転して符号付きで比較する */
+__attribute__((target("sse2")))
+static void
+pack4g_row_sse2(const uint8_t *src, int nbytes, const uint8_t *threshold,
+  uint8_t *dst)
+{
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    int x_byte;
+
+    /* 32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        int h;
+        for (h = 0; h < 2; h++) {
+            __m128i v = _mm_loadu_si128(
+              (const __m128i *)(src + x_byte * 8 + h * 16));
+            __m128i t = _mm_loadu_si128(
+              (const __m128i *)(threshold + h * 16));
+            unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(
+              _mm_xor_si128(v, sign), _mm_xor_si128(t, sign)));
+            dst[x_byte + h * 2 + 0] = bit_reverse[m & 0xff];
+            dst[x_byte + h * 2 + 1] = bit_reverse[m >> 8];
+        }
+    }
+    if (x_byte < nbytes)
+        pack4g_row_scalar(src + x_byte * 8, nbytes - x_byte, threshold,
+          dst + x_byte);
+}
+
+/* 16ビット x 8 を 32ビットに広げて madd で重みを掛ける（上位16ビットは 0 同士の積） */
+__attribute__((target("sse2")))
+static void
+scale_accum_sse2(int32_t *acc, const uint16_t *src, int n, int weight)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w = _mm_set1_epi32(weight);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128i a0 = _mm_loadu_si128((const __m128i *)&acc[i]);
+        __m128i a1 = _mm_loadu_si128((const __m128i *)&acc[i + 4]);
+        a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(v, zero), w));
+        a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(v, zero), w));
+        _mm_storeu_si128((__m128i *)&acc[i], a0);
+        _mm_storeu_si128((__m128i *)&acc[i + 4], a1);
+    }
+    if (i < n)
+        scale_accum_scalar(&acc[i], &src[i], n - i, weight);
+}
+
+/* 8ドット分の最近傍色インデックス */
+__attribute__((target("avx2")))
+static inline __m256i
+nearest8_avx2(__m256i rg, __m256i b0, const colorlut_t *lut)
+{
+    __m256i best = _mm256_setzero_si256();
+    __m256i index = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        __m256i dot = _mm256_add_epi32(
+          _mm256_madd_epi16(rg, _mm256_set1_epi32((int32_t)lut->rg_weight[i])),
+          _mm256_madd_epi16(b0, _mm256_set1_epi32((int32_t)lut->b_weight[i])));
+        __m256i score = _mm256_sub_epi32(_mm256_slli_epi32(dot, 1),
+          _mm256_set1_epi32(lut->norm[i]));
+        if (i == 0) {
+            best = score;
+        } else {
+            __m256i gt = _mm256_cmpgt_epi32(score, best);
+            best = _mm256_blendv_epi8(best, score, gt);
+            index = _mm256_blendv_epi8(index, _mm256_set1_epi32(i), gt);
+        }
+    }
+    return index;
+}
+
+/* 8ドット分のインデックス (32ビット x 8) を 2ビットずつ 2バイトに詰める */
+__attribute__((target("avx2")))
+static inline uint16_t
+pack2bpp_avx2(__m256i idx)
+{
+    __m256i v = _mm256_sllv_epi32(idx, _mm256_setr_epi32(6, 4, 2, 0, 6, 4, 2, 0));
+
+    v = _mm256_or_si256(v, _mm256_srli_si256(v, 4));
+    v = _mm256_or_si256(v, _mm256_srli_si256(v, 8));
+    return (uint16_t)((_mm256_cvtsi256_si32(v) & 0xff) |
+      ((_mm256_extract_epi32(v, 4) & 0xff) << 8));
+}
+
+__attribute__((target("avx2")))
+static void
+pack3_row_avx2(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    int x_byte;
+
+    /* 元画像32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        __m128i r[2], g[2], b[2];
+        uint16_t out[2];
+        int h;
+
+        deinterleave_rgb32_sse2(src + x_byte * 4 * 2 * 3, r, g, b);
+        for (h = 0; h < 2; h++) {
+            __m256i ra = _mm256_cvtepu16_epi32(
+              add_bias_sse2(average_pairs_sse2(r[h]), bias + h * 8));
+            __m256i ga = _mm256_cvtepu16_epi32(
+              add_bias_sse2(average_pairs_sse2(g[h]), bias + h * 8));
+            __m256i ba = _mm256_cvtepu16_epi32(
+              add_bias_sse2(average_pairs_sse2(b[h]), bias + h * 8));
+            __m256i rg = _mm256_or_si256(ra, _mm256_slli_epi32(ga, 16));
+            out[h] = pack2bpp_avx2(nearest8_avx2(rg, ba, lut));
+        }
+        memcpy(&dst[x_byte], out, 4);
+    }
+    if (x_byte < nbytes)
+        pack3_row_scalar(src + x_byte * 4 * 2 * 3, nbytes - x_byte, lut,
+          bias, dst + x_byte);
+}
+
+__attribute__((target("avx2")))
+static void
+pack3n_row_avx2(const uint8_t *src, int nbytes, const colorlut_t *lut,
+  const int16_t *bias, uint8_t *dst)
+{
+    int x_byte;
+
+    /* 元画像32ドット（出力8バイト）ずつ */
+    for (x_byte = 0; x_byte + 8 <= nbytes; x_byte += 8) {
+        __m128i r[2], g[2], b[2];
+        uint16_t out[4];
+        int q;
+
+        deinterleave_rgb32_sse2(src + x_byte * 4 * 3, r, g, b);
+        for (q = 0; q < 4; q++) {
+            /* 8ドットずつ 32ビットに広げる */
+            const int16_t *bq = bias + (q & 1) * 8;
+            __m128i r8 = (q & 1) ? _mm_srli_si128(r[q >> 1], 8) : r[q >> 1];
+            __m128i g8 = (q & 1) ? _mm_srli_si128(g[q >> 1], 8) : g[q >> 1];
+            __m128i b8 = (q & 1) ? _mm_srli_si128(b[q >> 1], 8) : b[q >> 1];
+            __m256i ra = _mm256_cvtepu16_epi32(
+              add_bias_sse2(_mm_cvtepu8_epi16(r8), bq));
+            __m256i ga = _mm256_cvtepu16_epi32(
+              add_bias_sse2(_mm_cvtepu8_epi16(g8), bq));
+            __m256i ba = _mm256_cvtepu16_epi32(
+              add_bias_sse2(_mm_cvtepu8_epi16(b8), bq));
+            __m256i rg = _mm256_or_si256(ra, _mm256_slli_epi32(ga, 16));
+            out[q] = pack2bpp_avx2(nearest8_avx2(rg, ba, lut));
+        }
+        memcpy(&dst[x_byte], out, 8);
+    }
+    if (x_byte < nbytes)
+        pack3n_row_scalar(src + x_byte * 4 * 3, nbytes - x_byte, lut,
+          bias, dst + x_byte);
+}
+
+__attribute__((target("avx2")))
+static void
+pack4_row_avx2(const uint8_t *src, int nbytes, const int32_t *threshold,
+  uint8_t *dst)
+{
+    const __m256i rg_weight = _mm256_set1_epi32((GRAY_WEIGHT_G << 16) | GRAY_WEIGHT_R);
+    const __m256i b_weight = _mm256_set1_epi32(GRAY_WEIGHT_B);
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    int x_byte;
+
+    /* 32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        __m128i r[2], g[2], b[2];
+        int q;
+
+        deinterleave_rgb32_sse2(src + x_byte * 8 * 3, r, g, b);
+        for (q = 0; q < 4; q++) {
+            /* 8ドットずつ 32ビットに広げる */
+            __m128i r8 = (q & 1) ? _mm_srli_si128(r[q >> 1], 8) : r[q >> 1];
+            __m128i g8 = (q & 1) ? _mm_srli_si128(g[q >> 1], 8) : g[q >> 1];
+            __m128i b8 = (q & 1) ? _mm_srli_si128(b[q >> 1], 8) : b[q >> 1];
+            __m256i rg = _mm256_or_si256(_mm256_cvtepu8_epi32(r8),
+              _mm256_slli_epi32(_mm256_cvtepu8_epi32(g8), 16));
+            __m256i y = _mm256_add_epi32(_mm256_madd_epi16(rg, rg_weight),
+              _mm256_madd_epi16(_mm256_cvtepu8_epi32(b8), b_weight));
+            __m256i t = _mm256_loadu_si256(
+              (const __m256i *)(threshold + q * 8));
+            __m256i m = _mm256_permutevar8x32_epi32(
+              _mm256_cmpgt_epi32(y, t), reverse);
+            dst[x_byte + q] =
+              (uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(m));
+        }
+    }
+    if (x_byte < nbytes)
+        pack4_row_scalar(src + x_byte * 8 * 3, nbytes - x_byte, threshold,
+          dst + x_byte);
+}
+
+__attribute__((target("avx2")))
+static void
+pack4g_row_avx2(const uint8_t *src, int nbytes, const uint8_t *threshold,
+  uint8_t *dst)
+{
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    /* 8バイト毎に並びを逆にして先頭ドットを movemask の各バイトの MSB にする */
+    const __m256i reverse = _mm256_setr_epi8(
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i t = _mm256_shuffle_epi8(_mm256_xor_si256(
+      _mm256_loadu_si256((const __m256i *)threshold), sign), reverse);
+    int x_byte;
+
+    /* 32ドット（出力4バイト）ずつ */
+    for (x_byte = 0; x_byte + 4 <= nbytes; x_byte += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + x_byte * 8));
+        uint32_t m;
+        v = _mm256_shuffle_epi8(_mm256_xor_si256(v, sign), reverse);
+        m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, t));
+        memcpy(&dst[x_byte], &m, 4);
+    }
+    if (x_byte < nbytes)
+        pack4g_row_scalar(src + x_byte * 8, nbytes - x_byte, threshold,
+          dst + x_byte);
+}
+
+__attribute__((target("avx2")))
+static void
+scale_accum_avx2(int32_t *acc, const uint16_t *src, int n, int weight)
+{
+    const __m256i w = _mm256_set1_epi32(weight);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(
+          _mm_loadu_si128((const __m128i *)&src[i]));
+        __m256i a = _mm256_loadu_si256((const __m256i *)&acc[i]);
+        _mm256_storeu_si256((__m256i *)&acc[i],
+          _mm256_add_epi32(a, _mm256_madd_epi16(v, w)));
+    }
+    if (i < n)
+        scale_accum_scalar(&acc[i], &src[i], n - i, weight);
+}
+
+static int
+cpu_has_sse2(void)
+{
+
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int
+cpu_has_avx2(void)
+{
+
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif /* HAVE_X86_SIMD */
+
+/* 先頭が最も速いものになるように並べておく */
+static const kernel_t kernels[] = {
+#ifdef HAVE_X86_SIMD
+    { .name = "avx2", .supported = cpu_has_avx2,
+      .pack3_row = pack3_row_avx2, .pack4_row = pack4_row_avx2,
+      .pack3n_row = pack3n_row_avx2, .pack4g_row = pack4g_row_avx2,
+      .scale_accum = scale_accum_avx2 },
+    { .name = "sse2", .supported = cpu_has_sse2,
+      .pack3_row = pack3_row_sse2, .pack4_row = pack4_row_sse2,
+      .pack3n_row = pack3n_row_sse2, .pack4g_row = pack4g_row_sse2,
+      .scale_accum = scale_accum_sse2 },
+#endif
+    { .name = "scalar", .supported = cpu_has_scalar,
+      .pack3_row = pack3_row_scalar, .pack4_row = pack4_row_scalar,
+      .pack3n_row = pack3n_row_scalar, .pack4g_row = pack4g_row_scalar,
+      .scale_accum = scale_accum_scalar },
+};
+#define NKERNELS        (sizeof(kernels) / sizeof(kernels[0]))
+
+/* 変換処理の実装を選ぶ（name が NULL なら使える中で最も速いもの） */
+static const kernel_t *
+select_kernel(const char *name)
+{
+    size_t k;
+
+    for (k = 0; k < NKERNELS; k++) {
+        if (name != NULL && strcmp(name, kernels[k].name) != 0)
+            continue;
+        if (kernels[k].supported())
+            return &kernels[k];
+    }
+    return NULL;
+}
+
+/*
+ * 直前のフレーム prev からの差分を符号化する
+ * 変化しない隙間が DELTA_MERGE_GAP バイト以下なら1つのレコードにまとめる
+ */
+size_t
+p6_delta_encode(const uint8_t *prev, const uint8_t *cur, size_t size,
+  uint8_t *out)
+{
+    size_t pos = 0, start, end, j;
+    uint8_t *o = out;
+
+    while (pos < size) {
+        if (cur[pos] == prev[pos]) {
+            pos++;
+            continue;
+        }
+        start = pos;
+        end = pos + 1;
+        for (j = end; j < size && j - start < 255; j++) {
+            if (cur[j] != prev[j])
+                end = j + 1;
+            else if (j - end + 1 > DELTA_MERGE_GAP)
+                break;
+        }
+        *o++ = (uint8_t)(end - start);
+        *o++ = start & 0xff;
+        *o++ = (start >> 8) & 0xff;
+        memcpy(o, &cur[start], end - start);
+        o += end - start;
+        pos = end;
+    }
+    *o++ = 0;
+    return (size_t)(o - out);
+}
+
+/*
+ * 差分を frame に適用する
+ * 読んだバイト数を返す（データが壊れている場合は -1）
+ */
+long
+p6_delta_decode(uint8_t *frame, size_t size, const uint8_t *in, size_t insize)
+{
+    size_t pos = 0, len, offset;
+
+    for (;;) {
+        if (pos >= insize)
+            return -1;
+        len = in[pos];
+        if (len == 0)
+            return (long)(pos + 1);
+        if (pos + 3 + len > insize)
+            return -1;
+        offset = in[pos + 1] | ((size_t)in[pos + 2] << 8);
+        if (offset + len > size)
+            return -1;
+        memcpy(&frame[offset], &in[pos + 3], len);
+        pos += 3 + len;
+    }
+}
+
+/*
+ * ランレングス符号化（1パス）
+ * RLE_MIN_RUN バイト以上同じ値が続くところだけ繰り返しにする
+ */
+size_t
+p6_rle_encode(const uint8_t *in, size_t size, uint8_t *out)
+{
+    size_t pos = 0, lit_start = 0, run;
+    uint8_t *o = out;
+
+    while (pos < size) {
+        for (run = 1; pos + run < size && run < RLE_MAX_RUN &&
+          in[pos + run] == in[pos]; run++)
+            continue;
+        if (run >= RLE_MIN_RUN || pos - lit_start == RLE_MAX_LITERAL) {
+            /* 溜まっているリテラルを出す */
+            if (pos > lit_start) {
+                *o++ = (uint8_t)(pos - lit_start);
+                memcpy(o, &in[lit_start], pos - lit_start);
+                o += pos - lit_start;
+            }
+            lit_start = pos;
+        }
+        if (run >= RLE_MIN_RUN) {
+            *o++ = 0x80 | (uint8_t)(run - 2);
+            *o++ = in[pos];
+            pos += run;
+            lit_start = pos;
+        } else {
+            pos++;
+        }
+    }
+    if (pos > lit_start) {
+        *o++ = (uint8_t)(pos - lit_start);
+        memcpy(o, &in[lit_start], pos - lit_start);
+        o += pos - lit_start;
+    }
+    *o++ = 0;
+    return (size_t)(o - out);
+}
+
+/*
+ * ランレングス符号化データを展開する
+ * 読んだバイト数を返す（データが壊れている場合や size と合わない場合は -1）
+ */
+long
+p6_rle_decode(uint8_t *out, size_t size, const uint8_t *in, size_t insize)
+{
+    size_t pos = 0, opos = 0, len;
+
+    for (;;) {
+        if (pos >= insize)
+            return -1;
+        if (in[pos] == 0)
+            return opos == size ? (long)(pos + 1) : -1;
+        if (in[pos] & 0x80) {
+            len = (in[pos] & 0x7f) + 2;
+            if (pos + 2 > insize || opos + len > size)
+                return -1;
+            memset(&out[opos], in[pos + 1], len);
+            pos += 2;
+        } else {
+            len = in[pos];
+            if (pos + 1 + len > insize || opos + len > size)
+                return -1;
+            memcpy(&out[opos], &in[pos + 1], len);
+            pos += 1 + len;
+        }
+        opos += len;
+    }
+}
+
+static inline unsigned int
+lz_hash(const uint8_t *p)
+{
+
+    return ((p[0] << 8 ^ p[1] << 4 ^ p[2]) * 2654435761U) >> (32 - P6_LZ_HASH_BITS);
+}
+
+/*
+ * 各位置の最長一致をハッシュチェーンで探す
+ * 同じ長さなら近いものを選ぶが、距離はどれも2バイトなのでコストは変わらない
+ */
+static void
+lz_find_matches(p6_lzwork_t *lz, const uint8_t *in, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < P6_LZ_HASH_SIZE; i++)
+        lz->head[i] = LZ_NIL;
+
+    for (i = 0; i < size; i++) {
+        size_t best_len = 0, best_dist = 0, max_len, len;
+        unsigned int h, chain = 0, cand;
+
+        lz->match_len[i] = 0;
+        lz->match_dist[i] = 0;
+        if (i + LZ_MIN_MATCH > size)
+            continue;
+
+        max_len = size - i < LZ_MAX_MATCH ? size - i : LZ_MAX_MATCH;
+        h = lz_hash(&in[i]);
+        for (cand = lz->head[h]; cand != LZ_NIL && chain < LZ_MAX_CHAIN;
+          cand = lz->chain[cand], chain++) {
+            if (in[cand + best_len] != in[i + best_len])
+                continue;
+            for (len = 0; len < max_len && in[cand + len] == in[i + len]; len++)
+                continue;
+            if (len > best_len) {
+                best_len = len;
+                best_dist = i - cand;
+                if (len == max_len)
+                    break;
+            }
+        }
+        if (best_len >= LZ_MIN_MATCH) {
+            lz->match_len[i] = (uint8_t)best_len;
+            lz->match_dist[i] = (uint16_t)best_dist;
+        }
+        lz->chain[i] = lz->head[h];
+        lz->head[h] = (uint16_t)i;
+    }
+}
+
+/*
+ * LZ 符号化（最適解析）
+ * 後ろから動的計画法で「圧縮サイズ x byte_cost + Z80 での展開Tステート」が
+ * 最小になるリテラル・一致の並びを求める
+ */
+size_t
+p6_lz_encode(p6_lzwork_t *lz, const uint8_t *in, size_t size, uint8_t *out,
+  unsigned int byte_cost)
+{
+    size_t i, k, pos;
+    uint8_t *o = out;
+
+    lz_find_matches(lz, in, size);
+
+    lz->cost[size] = 0;
+    for (i = size; i-- > 0;) {
+        uint32_t best = UINT32_MAX;
+        size_t max_lit = size - i < LZ_MAX_LITERAL ? size - i : LZ_MAX_LITERAL;
+
+        for (k = 1; k <= max_lit; k++) {
+            uint32_t c = (1 + k) * byte_cost + LZ_LITERAL_T + LZ_COPY_T * k +
+              lz->cost[i + k];
+            if (c < best) {
+                best = c;
+                lz->step_len[i] = (uint8_t)k;
+                lz->step_match[i] = 0;
+            }
+        }
+        for (k = LZ_MIN_MATCH; k <= lz->match_len[i]; k++) {
+            uint32_t c = 3 * byte_cost + LZ_MATCH_T + LZ_COPY_T * k +
+              lz->cost[i + k];
+            if (c < best) {
+                best = c;
+                lz->step_len[i] = (uint8_t)k;
+                lz->step_match[i] = 1;
+            }
+        }
+        lz->cost[i] = best;
+    }
+
+    for (pos = 0; pos < size; pos += lz->step_len[pos]) {
+        size_t len = lz->step_len[pos];
+        if (lz->step_match[pos]) {
+            *o++ = 0x80 | (uint8_t)(len - LZ_MIN_MATCH);
+            *o++ = lz->match_dist[pos] & 0xff;
+            *o++ = lz->match_dist[pos] >> 8;
+        } else {
+            *o++ = (uint8_t)len;
+            memcpy(o, &in[pos], len);
+            o += len;
+        }
+    }
+    *o++ = 0;
+    return (size_t)(o - out);
+}
+
+/*
+ * LZ 符号化データを展開する
+ * 読んだバイト数を返す（データが壊れている場合や size と合わない場合は -1）
+ */
+long
+p6_lz_decode(uint8_t *out, size_t size, const uint8_t *in, size_t insize)
+{
+    size_t pos = 0, opos = 0, len, dist, i;
+
+    for (;;) {
+        if (pos >= insize)
+            return -1;
+        if (in[pos] == 0)
+            return opos == size ? (long)(pos + 1) : -1;
+        if (in[pos] & 0x80) {
+            len = (in[pos] & 0x7f) + LZ_MIN_MATCH;
+            if (pos + 3 > insize || opos + len > size)
+                return -1;
+            dist = in[pos + 1] | ((size_t)in[pos + 2] << 8);
+            if (dist == 0 || dist > opos)
+                return -1;
+            /* 重なっている場合があるので1バイトずつ（Z80 の LDIR と同じ） */
+            for (i = 0; i < len; i++)
+                out[opos + i] = out[opos - dist + i];
+            pos += 3;
+        } else {
+            len = in[pos];
+            if (pos + 1 + len > insize || opos + len > size)
+                return -1;
+            memcpy(&out[opos], &in[pos + 1], len);
+            pos += 1 + len;
+        }
+        opos += len;
+    }
+}
+
+/*
+ * 1ラインで変換カーネルに渡す元画像の横幅 need が実際の横幅 width より長い場合は
+ * 右端の余りを黒にしたラインを row に作ってそちらを返す（画像の外は読まない）
+ */
+static inline const uint8_t *
+pad_row(const uint8_t *src, int width, int need, int channels, uint8_t *row)
+{
+
+    if (need <= width)
+        return src;
+    memcpy(row, src, (size_t)width * channels);
+    memset(row + (size_t)width * channels, 0, (size_t)(need - width) * channels);
+    return row;
+}
+
+/*
+ * SCREEN 3: 元画像横2ドットをP6画像1ドットにして 1バイトあたり4ドット
+ * native なら元画像は横 img_xsize / 2 ドットで、元画像1ドットがP6画像1ドット
+ */
+static void
+pack_screen3(const uint8_t *img, int width, int stride, int img_xsize,
+  int img_ysize, const colorlut_t *lut, const ordered_t *map, int native,
+  uint8_t *vram)
+{
+    const int img_stride = (((img_xsize / 2) + 3) / 4);
+    const int need = img_stride * 4 * (native ? 1 : 2);
+    uint8_t row[P6_XSIZE * 3];
+    int y;
+
+    for (y = 0; y < img_ysize; y++) {
+        const uint8_t *src = pad_row(&img[(size_t)y * stride], width, need,
+          3, row);
+        if (native) {
+            kernel->pack3n_row(src, img_stride, lut,
+              map->bias[y % map->size], &vram[y * img_stride]);
+        } else {
+            kernel->pack3_row(src, img_stride, lut,
+              map->bias[y % map->size], &vram[y * img_stride]);
+        }
+    }
+}
+
+/* SCREEN 4: 1バイトあたり8ドット（channels は元画像の 1ドットあたりのバイト数 1 か 3） */
+static void
+pack_screen4(const uint8_t *img, int width, int stride, int img_xsize,
+  int img_ysize, int channels, const ordered_t *map, uint8_t *vram)
+{
+    const int img_stride = ((img_xsize + 7) / 8);
+    uint8_t row[P6_XSIZE * 3];
+    int y;
+
+    for (y = 0; y < img_ysize; y++) {
+        const uint8_t *src = pad_row(&img[(size_t)y * stride], width,
+          img_stride * 8, channels, row);
+        if (channels == 1) {
+            kernel->pack4g_row(src, img_stride,
+              map->gray_threshold[y % map->size], &vram[y * img_stride]);
+        } else {
+            kernel->pack4_row(src, img_stride,
+              map->threshold[y % map->size], &vram[y * img_stride]);
+        }
+    }
+}
+
+/*
+ * --fit 用の面積平均による縮小・拡大
+ * 出力1ドットが覆う元画像の範囲と各ドットの重なりを重みとし、縦横別々に掛ける
+ * 重みは出力1ドットあたりの合計が SCALE_ONE になる固定小数点で、
+ * 横方向の結果は SCALE_HBITS ビットの小数部付きで1ライン分だけ持ち、
+ * 縦方向は出力1ライン分の累積バッファに足し込むので、
+ * 作業用メモリは出力の横幅に比例する分だけで済む
+ */
+#define SCALE_BITS      14
+#define SCALE_ONE       (1 << SCALE_BITS)
+#define SCALE_HBITS     7
+
+typedef struct {
+    int *first;                 /* 出力各ドットの最初の元画像の位置 */
+    int *ntaps;                 /* 出力各ドットが覆う元画像のドット数 */
+    int16_t *weights;           /* 出力ドット i の重みは weights[i * maxtaps ...] */
+    int maxtaps;
+} scaleaxis_t;
+
+/* 作業領域を切り分ける単位 */
+#define SCALE_ALIGN(n)  (((n) + 15) & ~(size_t)15)
+
+/* 出力1ドットは元画像 srcsize/dstsize ドット分なので高々これだけに掛かる */
+static inline int
+scaleaxis_maxtaps(int srcsize, int dstsize)
+{
+
+    return (srcsize + dstsize - 1) / dstsize + 1;
+}
+
+/* 1軸分の重みの表の大きさ */
+static size_t
+scaleaxis_size(int srcsize, int dstsize)
+{
+    const int maxtaps = scaleaxis_maxtaps(srcsize, dstsize);
+
+    return SCALE_ALIGN(sizeof(int) * dstsize) * 2 +
+      SCALE_ALIGN(sizeof(int16_t) * dstsize * maxtaps);
+}
+
+/*
+ * 元画像 srcsize ドットを dstsize ドットにする重みを work に求める
+ * 使った作業領域の次の位置を返す
+ */
+static uint8_t *
+scaleaxis_init(scaleaxis_t *axis, int srcsize, int dstsize, uint8_t *work)
+{
+    int i, t;
+
+    axis->maxtaps = scaleaxis_maxtaps(srcsize, dstsize);
+    axis->first = (int *)work;
+    work += SCALE_ALIGN(sizeof(int) * dstsize);
+    axis->ntaps = (int *)work;
+    work += SCALE_ALIGN(sizeof(int) * dstsize);
+    axis->weights = (int16_t *)work;
+    work += SCALE_ALIGN(sizeof(int16_t) * dstsize * axis->maxtaps);
+
+    for (i = 0; i < dstsize; i++) {
+        /* 座標は元画像1ドット = dstsize、出力1ドット = srcsize の単位 */
+        int64_t lo = (int64_t)i * srcsize, hi = (int64_t)(i + 1) * srcsize;
+        int16_t *w = &axis->weights[i * axis->maxtaps];
+        int first = (int)(lo / dstsize);
+        int last = (int)((hi + dstsize - 1) / dstsize);
+        int sum = 0, largest = 0;
+
+        axis->first[i] = first;
+        axis->ntaps[i] = last - first;
+        for (t = 0; t < last - first; t++) {
+            int64_t s0 = (int64_t)(first + t) * dstsize;
+            int64_t s1 = s0 + dstsize;
+            int64_t overlap = (s1 < hi ? s1 : hi) - (s0 > lo ? s0 : lo);
+            w[t] = (int16_t)((overlap * SCALE_ONE + srcsize / 2) / srcsize);
+            sum += w[t];
+            if (w[t] > w[largest])
+                largest = t;
+        }
+        /* 丸めの端数は一番重いところで吸収して合計を SCALE_ONE にする */
+        w[largest] += SCALE_ONE - sum;
+    }
+    return work;
+}
+
+size_t
+p6_scale_work_size(int width, int height, int channels, int xsize, int ysize)
+{
+
+    if (width < 1 || height < 1 || xsize < 1 || ysize < 1)
+        return 0;
+    return scaleaxis_size(width, xsize) + scaleaxis_size(height, ysize) +
+      SCALE_ALIGN(sizeof(int32_t) * xsize * channels) +
+      SCALE_ALIGN(sizeof(uint16_t) * xsize * channels);
+}
+
+int
+p6_scale(const uint8_t *src, int width, int height, int stride,
+  int channels, uint8_t *dst, int xsize, int ysize, void *work)
+{
+    scaleaxis_t xaxis, yaxis;
+    uint8_t *w = work;
+    uint16_t *hrow;
+    int32_t *acc;
+    int n = xsize * channels;
+    int cached = -1;
+    int x, y, t, u, c;
+
+    if (width < 1 || height < 1 || xsize < 1 || ysize < 1 ||
+      (channels != 1 && channels != 3) || stride < width * channels)
+        return -1;
+    w = scaleaxis_init(&xaxis, width, xsize, w);
+    w = scaleaxis_init(&yaxis, height, ysize, w);
+    acc = (int32_t *)w;
+    w += SCALE_ALIGN(sizeof(int32_t) * n);
+    hrow = (uint16_t *)w;
+
+    for (y = 0; y < ysize; y++) {
+        const int16_t *wy = &yaxis.weights[y * yaxis.maxtaps];
+
+        memset(acc, 0, sizeof(int32_t) * n);
+        for (t = 0; t < yaxis.ntaps[y]; t++) {
+            int sy = yaxis.first[y] + t;
+            if (wy[t] == 0)
+                continue;
+            /* 元画像のラインは昇順に使うので直前の1ラインだけ覚えておけばよい */
+            if (sy != cached) {
+                const uint8_t *row = &src[(size_t)sy * stride];
+                for (x = 0; x < xsize; x++) {
+                    const int16_t *wx = &xaxis.weights[x * xaxis.maxtaps];
+                    const uint8_t *p = &row[xaxis.first[x] * channels];
+                    int32_t sum[3] = { 0, 0, 0 };
+                    for (u = 0; u < xaxis.ntaps[x]; u++) {
+                        for (c = 0; c < channels; c++)
+                            sum[c] += wx[u] * p[u * channels + c];
+                    }
+                    for (c = 0; c < channels; c++) {
+                        hrow[x * channels + c] = (sum[c] +
+                          (1 << (SCALE_HBITS - 1))) >> SCALE_HBITS;
+                    }
+                }
+                cached = sy;
+            }
+            kernel->scale_accum(acc, hrow, n, wy[t]);
+        }
+        for (x = 0; x < n; x++) {
+            int v = (acc[x] + (1 << (SCALE_BITS + SCALE_HBITS - 1))) >>
+              (SCALE_BITS + SCALE_HBITS);
+            dst[(size_t)y * n + x] = v > 255 ? 255 : v;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Floyd-Steinberg 誤差拡散
+ * SCREEN 3 は横2ドット平均後の色を 4色パレットに、SCREEN 4 は rgb_to_gray() の
+ * 輝度をしきい値 128 で2値化し、誤差を右 7/16、左下 3/16、下 5/16、右下 1/16 に配る
+ * 誤差は 16倍した固定小数点で int16_t に溜める
+ *
+ * ライン y の各ドットはライン y-1 の同じ位置の2ドット右まで処理が済めば確定するので、
+ * ライン y を (y % スレッド数) 番目のスレッドに割り当て、上のラインの進み具合を
+ * 見ながら斜めに並行して進める（ウェーブフロント）
+ * 0 番は呼び出し元のスレッドで、残りは p6_fs_pool_t の空いているワーカースレッドを借りる
+ * 上のラインが追いついていなければ、FS_WAIT_AHEAD ドット先に進むまで条件変数で眠る
+ * 誤差バッファはスレッド数 + 1 ライン分を使い回す
+ */
+#define FS_WAIT_AHEAD   16
+
+typedef struct {
+    const uint8_t *img;
+    int width;                  /* 元画像の横幅 */
+    int stride;                 /* 元画像の1ラインのバイト数 */
+    int img_ysize;
+    int step;                   /* SCREEN 3 の1ドットあたりの元画像のドット数 */
+    int channels;               /* 元画像の1ドットあたりのバイト数 (1 か 3) */
+    int img_stride;
+    int mode;
+    int ndots;                  /* 1ラインのドット数 */
+    int nchannels;              /* 誤差の成分数 (SCREEN 3: RGB, SCREEN 4: 輝度) */
+    int nthreads;
+    int nrunning;               /* 担当分が終わっていないワーカースレッド数 (pool->lock で守る) */
+    p6_fs_pool_t *pool;
+    const colorlut_t *lut;
+    int16_t (*err)[FS_MAX_DOTS + 2][3];         /* nthreads + 1 ライン分 */
+    atomic_int progress[P6_YSIZE];             /* 各ラインの処理済みドット数 */
+    atomic_int waiting[P6_YSIZE];              /* 各ラインがここまで進むのを待っている（0 なら誰も待っていない） */
+    uint8_t *vram;
+} fsctx_t;
+
+typedef struct {
+    fsctx_t *ctx;
+    int thread;
+    int nstarted;               /* 作成できたスレッド数（残りのラインは 0 番が受け持つ） */
+} fsarg_t;
+
+/* ライン y-1 が x ドット目の2ドット先まで済むのを待つ */
+static inline void
+fs_wait(fsctx_t *ctx, int y, int x)
+{
+    int need, ahead;
+
+    if (y == 0)
+        return;
+    need = x + 2 < ctx->ndots ? x + 2 : ctx->ndots;
+    if (atomic_load_explicit(&ctx->progress[y - 1],
+      memory_order_acquire) >= need)
+        return;
+    /*
+     * 待つ印を付けてから進み具合を見直す（どちらも seq_cst なので、fs_row() が
+     * 進み具合を書いた後に印を見落とすことはない）
+     * 起こされる回数を減らすため、少し先まで進んでから起こしてもらう
+     */
+    ahead = need + FS_WAIT_AHEAD < ctx->ndots ? need + FS_WAIT_AHEAD : ctx->ndots;
+    pthread_mutex_lock(&ctx->pool->lock);
+    for (;;) {
+        atomic_store(&ctx->waiting[y - 1], ahead);
+        if (atomic_load(&ctx->progress[y - 1]) >= need)
+            break;
+        pthread_cond_wait(&ctx->pool->progress, &ctx->pool->lock);
+    }
+    atomic_store(&ctx->waiting[y - 1], 0);
+    pthread_mutex_unlock(&ctx->pool->lock);
+}
+
+static void
+fs_row(fsctx_t *ctx, int y)
+{
+    const int nslots = ctx->nthreads + 1;
+    int16_t (*cur)[3] = ctx->err[y % nslots] + 1;
+    int16_t (*next)[3] = ctx->err[(y + 1) % nslots] + 1;
+    uint8_t row[P6_XSIZE * 3];
+    const uint8_t *src = pad_row(&ctx->img[(size_t)y * ctx->stride],
+      ctx->width, ctx->ndots * ctx->step, ctx->channels, row);
+    uint8_t *dst = &ctx->vram[y * ctx->img_stride];
+    int right[3] = { 0, 0, 0 };
+    int x, c, want;
+
+    /* 下のラインの誤差バッファはこのラインが使い始める前に空にする */
+    memset(ctx->err[(y + 1) % nslots], 0, sizeof(ctx->err[0]));
+    memset(dst, 0, ctx->img_stride);
+
+    for (x = 0; x < ctx->ndots; x++) {
+        int v[3], e[3], q[3];
+
+        fs_wait(ctx, y, x);
+
+        if (ctx->mode == 3) {
+            /* 横2ドット平均（pack3_row_scalar と同じ読み方） */
+            const uint8_t *p1 = &src[x * ctx->step * 3];
+            const uint8_t *p2 = &src[(x * ctx->step + ctx->step - 1) * 3];
+            unsigned int index;
+            for (c = 0; c < 3; c++) {
+                int acc = cur[x][c] + right[c];
+                v[c] = clamp255((p1[c] + p2[c]) / 2 + ((acc + 8) >> 4));
+            }
+            index = lut_nearest_color(ctx->lut, v[0], v[1], v[2]);
+            q[0] = ctx->lut->palette->colors[index].r;
+            q[1] = ctx->lut->palette->colors[index].g;
+            q[2] = ctx->lut->palette->colors[index].b;
+            dst[x / 4] |= (index & 0x03U) << ((3 - x % 4) * 2);
+        } else {
+            const uint8_t *p = &src[x * ctx->channels];
+            int acc = cur[x][0] + right[0];
+            int gray = (ctx->channels == 1) ? p[0] : rgb_to_gray(p[0], p[1], p[2]);
+            v[0] = clamp255(gray + ((acc + 8) >> 4));
+            q[0] = v[0] > 127 ? 255 : 0;
+            if (q[0] != 0)
+                dst[x / 8] |= 0x80U >> (x % 8);
+        }
+
+        for (c = 0; c < ctx->nchannels; c++) {
+            e[c] = v[c] - q[c];
+            right[c] = e[c] * 7;
+            next[x - 1][c] += e[c] * 3;
+            next[x][c] += e[c] * 5;
+            next[x + 1][c] += e[c] * 1;
+        }
+        atomic_store(&ctx->progress[y], x + 1);
+        want = atomic_load(&ctx->waiting[y]);
+        if (want != 0 && x + 1 >= want &&
+          atomic_exchange(&ctx->waiting[y], 0) != 0) {
+            pthread_mutex_lock(&ctx->pool->lock);
+            pthread_cond_broadcast(&ctx->pool->progress);
+            pthread_mutex_unlock(&ctx->pool->lock);
+        }
+    }
+}
+
+static void
+fs_worker(fsarg_t *fa)
+{
+    fsctx_t *ctx = fa->ctx;
+    int y;
+
+    for (y = 0; y < ctx->img_ysize; y++) {
+        int t = y % ctx->nthreads;
+        if (t == fa->thread || (fa->thread == 0 && t >= fa->nstarted))
+            fs_row(ctx, y);
+    }
+}
+
+/* プールのワーカースレッド: フレームの担当分が来るのを待って処理する */
+static void *
+fs_pool_thread(void *arg)
+{
+    p6_fs_worker_t *w = arg;
+    p6_fs_pool_t *pool = w->pool;
+    fsarg_t *fa;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (w->task == NULL && !pool->quit)
+            pthread_cond_wait(&w->wake, &pool->lock);
+        if (w->task == NULL)
+            break;
+        fa = w->task;
+        pthread_mutex_unlock(&pool->lock);
+        fs_worker(fa);
+        pthread_mutex_lock(&pool->lock);
+        /* これ以降 fa は呼び出し元が捨てるので触らない */
+        w->task = NULL;
+        fa->ctx->nrunning--;
+        pthread_cond_broadcast(&pool->progress);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int
+p6_fs_pool_init(p6_fs_pool_t *pool, int nthreads)
+{
+    int i;
+
+    if (nthreads < 1 || nthreads > P6_FS_POOL_MAX_THREADS)
+        return -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->progress, NULL);
+    pool->quit = 0;
+    for (i = 0; i < nthreads; i++) {
+        p6_fs_worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        w->task = NULL;
+        pthread_cond_init(&w->wake, NULL);
+        if (pthread_create(&w->thread, NULL, fs_pool_thread, w) != 0) {
+            pthread_cond_destroy(&w->wake);
+            break;
+        }
+    }
+    pool->nthreads = i;
+    if (i == 0) {
+        pthread_cond_destroy(&pool->progress);
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void
+p6_fs_pool_destroy(p6_fs_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_cond_signal(&pool->workers[i].wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_cond_destroy(&pool->workers[i].wake);
+    }
+    pthread_cond_destroy(&pool->progress);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static void
+dither_fs(const p6_config_t *cf, const uint8_t *img, int width, int stride,
+  int channels, int native, uint8_t *vram)
+{
+    int16_t err[P6_MAX_FRAME_THREADS + 1][FS_MAX_DOTS + 2][3];
+    fsarg_t args[P6_MAX_FRAME_THREADS];
+    p6_fs_pool_t *pool = cf->fs_pool;
+    fsctx_t ctx;
+    int i, t, y, nstarted;
+
+    ctx.img = img;
+    ctx.width = width;
+    ctx.stride = stride;
+    ctx.img_ysize = cf->ysize;
+    ctx.step = (cf->mode == 3 && !native) ? 2 : 1;
+    ctx.channels = channels;
+    ctx.mode = cf->mode;
+    if (cf->mode == 3) {
+        ctx.img_stride = ((cf->xsize / 2) + 3) / 4;
+        ctx.ndots = ctx.img_stride * 4;
+        ctx.nchannels = 3;
+    } else {
+        ctx.img_stride = (cf->xsize + 7) / 8;
+        ctx.ndots = ctx.img_stride * 8;
+        ctx.nchannels = 1;
+    }
+    ctx.nthreads = cf->frame_threads;
+    if (ctx.nthreads > ctx.img_ysize)
+        ctx.nthreads = ctx.img_ysize;
+    ctx.nrunning = 0;
+    ctx.pool = pool;
+    ctx.lut = &color_luts[cf->color_type - 1];
+    ctx.err = err;
+    ctx.vram = vram;
+    for (y = 0; y < ctx.img_ysize; y++) {
+        atomic_init(&ctx.progress[y], 0);
+        atomic_init(&ctx.waiting[y], 0);
+    }
+    /* 最初のラインの誤差バッファ */
+    memset(err[0], 0, sizeof(err[0]));
+
+    for (t = 0; t < ctx.nthreads; t++) {
+        args[t].ctx = &ctx;
+        args[t].thread = t;
+    }
+    /*
+     * 空いているワーカースレッドを借りる
+     * 借りられなかった分のラインは呼び出し元のスレッドが処理する
+     */
+    nstarted = 1;
+    if (ctx.nthreads > 1 && pool != NULL) {
+        /* ワーカースレッドはロックを離すまで動かないので、nstarted は後で決めてよい */
+        pthread_mutex_lock(&pool->lock);
+        for (i = 0; i < pool->nthreads && nstarted < ctx.nthreads; i++) {
+            if (pool->workers[i].task == NULL) {
+                pool->workers[i].task = &args[nstarted++];
+                pthread_cond_signal(&pool->workers[i].wake);
+            }
+        }
+        for (t = 0; t < nstarted; t++)
+            args[t].nstarted = nstarted;
+        ctx.nrunning = nstarted - 1;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    args[0].nstarted = nstarted;
+    fs_worker(&args[0]);
+    if (nstarted > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (ctx.nrunning > 0)
+            pthread_cond_wait(&pool->progress, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * パレット番号の画像をそのまま変換する
+ * SCREEN 3 は横2ドットのパレット番号の組ごとに平均色の最近傍色を pair に覚えておき
+ * （組は最大 256x256 通りあるので使われたものだけ求める）、
+ * 横半分の画像はパレットの各色の最近傍色を引く
+ * 横幅 width より右のドットは黒として扱う
+ */
+static void
+pack_indexed3(const uint8_t *pixels, int width, int stride, int img_xsize,
+  int img_ysize, const uint8_t (*palette)[3], int ncolors,
+  const colorlut_t *lut, int native, uint8_t *pair, uint8_t *vram)
+{
+    const int img_stride = (((img_xsize / 2) + 3) / 4);
+    const int step = native ? 1 : 2;
+    uint8_t single[256];
+    int i, x, y;
+
+    if (native) {
+        for (i = 0; i < ncolors; i++) {
+            single[i] = lut_nearest_color(lut, palette[i][0], palette[i][1],
+              palette[i][2]);
+        }
+    } else {
+        memset(pair, LUT_AMBIGUOUS, (size_t)ncolors * 256);
+    }
+
+    for (y = 0; y < img_ysize; y++) {
+        const uint8_t *src = &pixels[(size_t)y * stride];
+        uint8_t *dst = &vram[y * img_stride];
+        for (x = 0; x < img_stride; x++) {
+            unsigned int out_byte = 0;
+            for (i = 0; i < 4; i++) {
+                int sx = (x * 4 + i) * step;
+                unsigned int color;
+                if (sx + step > width) {
+                    /* 右端の余り（黒か黒と平均した色） */
+                    if (sx >= width) {
+                        color = lut_nearest_color(lut, 0, 0, 0);
+                    } else {
+                        const uint8_t *p = palette[src[sx]];
+                        color = lut_nearest_color(lut, p[0] / 2, p[1] / 2,
+                          p[2] / 2);
+                    }
+                } else if (native) {
+                    color = single[src[sx]];
+                } else {
+                    int a = src[sx], b = src[sx + 1];
+                    uint8_t *p = &pair[a * 256 + b];
+                    if (*p == LUT_AMBIGUOUS) {
+                        *p = lut_nearest_color(lut,
+                          (palette[a][0] + palette[b][0]) / 2,
+                          (palette[a][1] + palette[b][1]) / 2,
+                          (palette[a][2] + palette[b][2]) / 2);
+                    }
+                    color = *p;
+                }
+                out_byte = (out_byte << 2) | color;
+            }
+            dst[x] = out_byte;
+        }
+    }
+}
+
+/*
+ * SCREEN 4 はパレットの各色の輝度を求めておき、1ライン分の輝度を引いてから
+ * グレースケール画像用の変換カーネルで2値化する
+ */
+static void
+pack_indexed4(const uint8_t *pixels, int width, int stride, int img_xsize,
+  int img_ysize, const uint8_t (*palette)[3], int ncolors,
+  const ordered_t *map, uint8_t *vram)
+{
+    const int img_stride = ((img_xsize + 7) / 8);
+    const int n = width < img_stride * 8 ? width : img_stride * 8;
+    uint8_t gray[256], row[P6_XSIZE];
+    int i, x, y;
+
+    for (i = 0; i < ncolors; i++)
+        gray[i] = rgb_to_gray(palette[i][0], palette[i][1], palette[i][2]);
+    memset(row, 0, sizeof(row));
+    for (y = 0; y < img_ysize; y++) {
+        const uint8_t *src = &pixels[(size_t)y * stride];
+        for (x = 0; x < n; x++)
+            row[x] = gray[src[x]];
+        kernel->pack4g_row(row, img_stride, map->gray_threshold[y % map->size],
+          &vram[y * img_stride]);
+    }
+}
+
+int
+p6_init(const char *kernel_name)
+{
+
+    kernel = select_kernel(kernel_name);
+    if (kernel == NULL)
+        return -1;
+    init_color_luts();
+    init_ordered_maps();
+#ifdef HAVE_X86_SIMD
+    init_bit_reverse();
+#endif
+    return 0;
+}
+
+const char *
+p6_kernel_name(void)
+{
+
+    return kernel != NULL ? kernel->name : NULL;
+}
+
+size_t
+p6_vram_size(int mode, int xsize, int ysize)
+{
+
+    if (mode == 3)
+        return (size_t)((xsize / 2 + 3) / 4) * ysize;
+    return (size_t)((xsize + 7) / 8) * ysize;
+}
+
+int
+p6_check_size(const p6_config_t *cf, int width, int height)
+{
+
+    if (cf->mode == 3 && cf->xsize % 2 == 0 &&
+      width == cf->xsize / 2 && height == cf->ysize)
+        return 1;
+    if (width == cf->xsize && height == cf->ysize)
+        return 0;
+    return -1;
+}
+
+/* 変換の設定が正しいか */
+static int
+check_config(const p6_config_t *cf)
+{
+
+    if (cf->mode != 3 && cf->mode != 4)
+        return -1;
+    if (cf->mode == 3 && (cf->color_type < 1 || cf->color_type > 2))
+        return -1;
+    if (cf->xsize < 1 || cf->xsize > P6_XSIZE ||
+      cf->ysize < 1 || cf->ysize > P6_YSIZE)
+        return -1;
+    if (cf->dither < P6_DITHER_NONE || cf->dither > P6_DITHER_BAYER8)
+        return -1;
+    if (cf->dither == P6_DITHER_FS &&
+      (cf->frame_threads < 1 || cf->frame_threads > P6_MAX_FRAME_THREADS))
+        return -1;
+    return 0;
+}
+
+int
+p6_convert(const p6_config_t *cf, const uint8_t *pixels, int width,
+  int height, int stride, int channels, uint8_t *out)
+{
+    int native;
+
+    native = p6_check_size(cf, width, height);
+    if (native < 0 || check_config(cf) != 0)
+        return -1;
+    if (channels != 3 && !(cf->mode == 4 && channels == 1))
+        return -1;
+    if (stride < width * channels)
+        return -1;
+
+    if (cf->dither == P6_DITHER_FS)
+        dither_fs(cf, pixels, width, stride, channels, native, out);
+    else if (cf->mode == 3)
+        pack_screen3(pixels, width, stride, cf->xsize, cf->ysize,
+          &color_luts[cf->color_type - 1], ordered_map(cf->dither), native,
+          out);
+    else
+        pack_screen4(pixels, width, stride, cf->xsize, cf->ysize, channels,
+          ordered_map(cf->dither), out);
+    return 0;
+}
+
+int
+p6_convert_screen3(const uint8_t *rgb, int w, int h, int stride, uint8_t *out)
+{
+    const p6_config_t cf = {
+        .mode = 3, .color_type = 1, .xsize = w, .ysize = h,
+        .dither = P6_DITHER_NONE, .frame_threads = 1,
+    };
+
+    return p6_convert(&cf, rgb, w, h, stride, 3, out);
+}
+
+int
+p6_convert_screen4(const uint8_t *rgb, int w, int h, int stride, uint8_t *out)
+{
+    const p6_config_t cf = {
+        .mode = 4, .color_type = 1, .xsize = w, .ysize = h,
+        .dither = P6_DITHER_NONE, .frame_threads = 1,
+    };
+
+    return p6_convert(&cf, rgb, w, h, stride, 3, out);
+}
+
+int
+p6_convert_indexed(const p6_config_t *cf, const uint8_t *pixels, int width,
+  int height, int stride, const uint8_t (*palette)[3], int ncolors,
+  uint8_t *pair, uint8_t *out)
+{
+    int native;
+
+    native = p6_check_size(cf, width, height);
+    if (native < 0 || check_config(cf) != 0 || stride < width ||
+      ncolors < 1 || ncolors > 256)
+        return -1;
+
+    /* ディザで色が混ざらなければパレット番号のまま変換できる */
+    if (cf->mode == 3 && cf->dither == P6_DITHER_NONE) {
+        pack_indexed3(pixels, width, stride, cf->xsize, cf->ysize, palette,
+          ncolors, &color_luts[cf->color_type - 1], native, pair, out);
+        return 0;
+    }
+    if (cf->mode == 4 && cf->dither != P6_DITHER_FS) {
+        pack_indexed4(pixels, width, stride, cf->xsize, cf->ysize, palette,
+          ncolors, ordered_map(cf->dither), out);
+        return 0;
+    }
+    return -1;
+}
+
+/* セルフテスト用の乱数 (xorshift32) */
+static uint32_t
+selftest_random(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/*
+ * セルフテスト用の1ライン分の画素を作る
+ * 同距離の境界を通りやすい値を混ぜたものと完全な乱数を交互に使う
+ */
+static void
+selftest_fill_row(uint8_t *row, size_t size, unsigned int pass, uint32_t *state)
+{
+    static const uint8_t edges[] = {
+        0, 1, 63, 64, 65, 127, 128, 129, 191, 192, 254, 255
+    };
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        uint32_t v = selftest_random(state);
+        if (pass % 2 == 0)
+            row[i] = edges[v % sizeof(edges)];
+        else
+            row[i] = (uint8_t)(v >> 8);
+    }
+}
+
+/* 各変換カーネルの出力を scalar 版と比較する */
+static int
+selftest_kernels(void)
+{
+    /* 最後のバイトは横方向のはみ出しを読むので余分に確保しておく */
+    uint8_t src[(P6_XSIZE + 8) * 3];
+    uint8_t expect[P6_XSIZE / 4], actual[P6_XSIZE / 4];
+    uint16_t hrow[P6_XSIZE * 3];
+    int32_t acc_expect[P6_XSIZE * 3], acc_actual[P6_XSIZE * 3];
+    uint8_t expanded[(P6_XSIZE + 8) * 3];
+    static const char *const what[] = {
+        "SCREEN 3 (color,,1)", "SCREEN 3 (color,,2)", "SCREEN 4",
+        "SCREEN 3 横半分 (color,,1)", "SCREEN 3 横半分 (color,,2)",
+        "SCREEN 4 グレースケール"
+    };
+    const kernel_t *scalar = select_kernel("scalar");
+    uint32_t state = 0x12345678;
+    unsigned int pass;
+    size_t k;
+    int i, nbytes, ok_gray = 1, rv = 0;
+
+    /* 横半分の変換は横2倍に拡大してから平均した場合と同じか */
+    for (pass = 0; pass < 20000 && rv == 0; pass++) {
+        const ordered_t *map = &ordered_maps[pass % 3];
+        int row = pass / 3 % map->size;
+        int x;
+        selftest_fill_row(src, sizeof(src), pass, &state);
+        for (x = 0; x < P6_XSIZE + 8; x++)
+            memcpy(&expanded[x * 3], &src[x / 2 * 3], 3);
+        nbytes = (pass % 8 == 7) ? (int)(pass / 8 % 32) + 1 : P6_XSIZE / 8;
+        for (i = 0; i < 2; i++) {
+            scalar->pack3_row(expanded, nbytes, &color_luts[i], map->bias[row],
+              expect);
+            scalar->pack3n_row(src, nbytes, &color_luts[i], map->bias[row],
+              actual);
+            if (memcmp(expect, actual, nbytes) != 0) {
+                fprintf(stderr, "セルフテスト失敗: SCREEN 3 (color,,%d) の"
+                  "横半分の変換が横2倍の場合と一致しません\n", i + 1);
+                rv = -1;
+            }
+        }
+    }
+    printf("SCREEN 3 横半分の変換: %s\n", rv == 0 ? "OK" : "NG");
+
+    /* グレースケール画像の変換は RGB に広げてから変換した場合と同じか */
+    for (pass = 0; pass < 20000 && ok_gray; pass++) {
+        const ordered_t *map = &ordered_maps[pass % 3];
+        int row = pass / 3 % map->size;
+        int x;
+        selftest_fill_row(src, sizeof(src), pass, &state);
+        for (x = 0; x < P6_XSIZE + 8; x++)
+            memset(&expanded[x * 3], src[x], 3);
+        nbytes = (pass % 8 == 7) ? (int)(pass / 8 % 32) + 1 : P6_XSIZE / 8;
+        scalar->pack4_row(expanded, nbytes, map->threshold[row], expect);
+        scalar->pack4g_row(src, nbytes, map->gray_threshold[row], actual);
+        if (memcmp(expect, actual, nbytes) != 0) {
+            fprintf(stderr, "セルフテスト失敗: SCREEN 4 のグレースケール画像の"
+              "変換が RGB の場合と一致しません\n");
+            ok_gray = 0;
+            rv = -1;
+        }
+    }
+    printf("SCREEN 4 グレースケール画像の変換: %s\n", ok_gray ? "OK" : "NG");
+
+    for (k = 0; k < NKERNELS; k++) {
+        const kernel_t *kp = &kernels[k];
+        int ok = 1;
+        if (kp == scalar)
+            continue;
+        if (!kp->supported()) {
+            printf("変換カーネル %s: このCPUでは使えません\n", kp->name);
+            continue;
+        }
+        for (pass = 0; pass < 20000 && ok; pass++) {
+            /* ディザなし・4x4・8x8 の各ラインの表を順に試す */
+            const ordered_t *map = &ordered_maps[pass % 3];
+            int row = pass / 3 % map->size;
+            selftest_fill_row(src, sizeof(src), pass, &state);
+            /* 半端な横幅も試す */
+            nbytes = (pass % 8 == 7) ? (int)(pass / 8 % 32) + 1 : P6_XSIZE / 8;
+            for (i = 0; i < 6 && ok; i++) {
+                if (i == 5) {
+                    scalar->pack4g_row(src, nbytes, map->gray_threshold[row],
+                      expect);
+                    kp->pack4g_row(src, nbytes, map->gray_threshold[row],
+                      actual);
+                } else if (i >= 3) {
+                    scalar->pack3n_row(src, nbytes, &color_luts[i - 3],
+                      map->bias[row], expect);
+                    kp->pack3n_row(src, nbytes, &color_luts[i - 3],
+                      map->bias[row], actual);
+                } else if (i < 2) {
+                    scalar->pack3_row(src, nbytes, &color_luts[i],
+                      map->bias[row], expect);
+                    kp->pack3_row(src, nbytes, &color_luts[i],
+                      map->bias[row], actual);
+                } else {
+                    scalar->pack4_row(src, nbytes, map->threshold[row],
+                      expect);
+                    kp->pack4_row(src, nbytes, map->threshold[row], actual);
+                }
+                if (memcmp(expect, actual, nbytes) != 0) {
+                    fprintf(stderr, "セルフテスト失敗: 変換カーネル %s の"
+                      " %s の結果が一致しません\n", kp->name, what[i]);
+                    ok = 0;
+                }
+            }
+        }
+        for (pass = 0; pass < 1000 && ok; pass++) {
+            /* --fit の縦方向の足し込み（半端な長さも試す） */
+            int n = (int)(pass % (P6_XSIZE * 3)) + 1;
+            int weight = selftest_random(&state) % (SCALE_ONE + 1);
+            for (i = 0; i < n; i++) {
+                hrow[i] = selftest_random(&state) % (255 << SCALE_HBITS) + 1;
+                acc_expect[i] = acc_actual[i] =
+                  selftest_random(&state) % (SCALE_ONE << SCALE_HBITS);
+            }
+            scalar->scale_accum(acc_expect, hrow, n, weight);
+            kp->scale_accum(acc_actual, hrow, n, weight);
+            if (memcmp(acc_expect, acc_actual, sizeof(int32_t) * n) != 0) {
+                fprintf(stderr, "セルフテスト失敗: 変換カーネル %s の"
+                  " 縮小・拡大の結果が一致しません\n", kp->name);
+                ok = 0;
+            }
+        }
+        printf("変換カーネル %s: %s\n", kp->name, ok ? "OK" : "NG");
+        if (!ok)
+            rv = -1;
+    }
+    return rv;
+}
+
+/* 誤差拡散の結果がスレッド数によらず同じか */
+static int
+selftest_dither(void)
+{
+    static const struct {
+        int mode, color_type;
+    } cases[] = { { 3, 1 }, { 3, 2 }, { 4, 1 } };
+    const size_t imgsize = (size_t)P6_XSIZE * P6_YSIZE * 3;
+    uint8_t *img, expect[P6_VRAM_SIZE], actual[P6_VRAM_SIZE];
+    p6_fs_pool_t pool;
+    uint32_t state = 1;
+    unsigned int i;
+    size_t j;
+    int rv = 0;
+
+    img = malloc(imgsize);
+    if (img == NULL) {
+        fprintf(stderr, "メモリが足りません\n");
+        return -1;
+    }
+    if (p6_fs_pool_init(&pool, 3) != 0) {
+        fprintf(stderr, "スレッドを作れませんでした\n");
+        free(img);
+        return -1;
+    }
+    for (j = 0; j < imgsize; j++)
+        img[j] = (j / 3 % P6_XSIZE) + (selftest_random(&state) & 0x3f);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        p6_config_t cf = {
+            .mode = cases[i].mode,
+            .color_type = cases[i].color_type,
+            .xsize = P6_XSIZE,
+            .ysize = P6_YSIZE,
+            .dither = P6_DITHER_FS,
+            .frame_threads = 1,
+        };
+        int ok;
+
+        dither_fs(&cf, img, P6_XSIZE, P6_XSIZE * 3, 3, 0, expect);
+        cf.frame_threads = 4;
+        cf.fs_pool = &pool;
+        dither_fs(&cf, img, P6_XSIZE, P6_XSIZE * 3, 3, 0, actual);
+        ok = memcmp(expect, actual, p6_vram_size(cf.mode, cf.xsize,
+          cf.ysize)) == 0;
+        if (!ok)
+            rv = -1;
+        printf("誤差拡散 SCREEN %d color,,%d 1スレッドと4スレッド: %s\n",
+          cases[i].mode, cases[i].color_type, ok ? "OK" : "NG");
+    }
+    p6_fs_pool_destroy(&pool);
+    free(img);
+    return rv;
+}
+
+int
+p6_selftest(void)
+{
+    unsigned int i, rgb;
+    int rv = 0;
+
+    for (i = 0; i < 2; i++) {
+        const colorlut_t *lut = &color_luts[i];
+        unsigned int nambiguous = 0;
+        int ok = 1;
+        for (rgb = 0; rgb < (1U << 24); rgb++) {
+            uint8_t r = rgb >> 16, g = rgb >> 8, b = rgb;
+            if (lut_nearest_color(lut, r, g, b) !=
+              nearest_color(&p6palette[i], r, g, b)) {
+                fprintf(stderr, "セルフテスト失敗: color,,%u の最近傍色テーブル"
+                  " (R,G,B)=(%u,%u,%u)\n", i + 1, r, g, b);
+                ok = 0;
+                rv = -1;
+                break;
+            }
+        }
+        for (rgb = 0; rgb < LUT_DIM * LUT_DIM * LUT_DIM; rgb++) {
+            if (lut->cube[rgb] == LUT_AMBIGUOUS)
+                nambiguous++;
+        }
+        printf("color,,%u 最近傍色テーブル: %s（総当たりに回るセル %u/%u）\n",
+          i + 1, ok ? "OK" : "NG", nambiguous,
+          LUT_DIM * LUT_DIM * LUT_DIM);
+    }
+    for (rgb = 0; rgb < (1U << 24); rgb++) {
+        uint8_t r = rgb >> 16, g = rgb >> 8, b = rgb;
+        uint8_t gray = rgb_to_gray(r, g, b);
+        int y = GRAY_WEIGHT_R * r + GRAY_WEIGHT_G * g + GRAY_WEIGHT_B * b;
+        if ((gray > 127) != (y >= GRAY_THRESHOLD)) {
+            fprintf(stderr, "セルフテスト失敗: 2値化しきい値"
+              " (R,G,B)=(%u,%u,%u)\n", r, g, b);
+            rv = -1;
+            break;
+        }
+    }
+    printf("SCREEN 4 2値化しきい値: %s\n", rgb == (1U << 24) ? "OK" : "NG");
+    if (selftest_kernels() != 0)
+        rv = -1;
+    if (selftest_dither() != 0)
+        rv = -1;
+    return rv;
+}
@@ -0,0 +1,189 @@
+/*
+ * img2p6.h
+ * 画像を PC-6001 (初代) SCREEN 3/4 の VRAM形式に変換するライブラリ (libimg2p6)
+ *
+ * 入力画像・出力VRAMデータ・作業領域のバッファは全て呼び出し側が用意し、
+ * 変換・符号化の関数の中ではメモリを確保しない
+ * 誤差拡散を複数スレッドで行う場合のスレッドも p6_fs_pool_init() で先に作っておき、
+ * 変換の関数の中ではスレッドを作らない
+ * 最初に1度だけ p6_init() を呼んでおくこと（以降の関数はスレッドセーフ）
+ *
+ * 入力画像は1ドット channels バイト (RGB なら 3、グレースケールなら 1) で、
+ * 各ラインの先頭は stride バイトずつ離れている
+ * SCREEN 3 は元画像の横2ドットの平均色を出力の1ドットにするので、
+ * 横幅は出力のドット数の2倍で数える（p6_config_t の xsize も同じ）
+ */
+
+#ifndef IMG2P6_H
+#define IMG2P6_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* 変換できる最大の大きさ（SCREEN 3 の横は元画像のドット数） */
+#define P6_XSIZE        256
+#define P6_YSIZE        192
+
+/* 出力VRAMデータの最大サイズ（SCREEN 3/4 とも 1ライン 32バイト） */
+#define P6_VRAM_SIZE    ((P6_XSIZE / 8) * P6_YSIZE)
+
+/* 1フレームの符号化結果の最大サイズ */
+#define P6_CODE_BUF_SIZE        (P6_VRAM_SIZE * 2)
+
+/* p6_convert_indexed() の SCREEN 3 で使う作業領域の大きさ */
+#define P6_PAIR_TABLE_SIZE      (256 * 256)
+
+/*
+ * 誤差拡散で1フレームに使う最大スレッド数
+ * 誤差バッファは (スレッド数 + 1) ライン分なので 1スレッドなら2ライン
+ */
+#define P6_MAX_FRAME_THREADS    16
+
+/* LZ 符号化で圧縮データ1バイトを何Tステートとみなすかの既定値 */
+#define P6_LZ_BYTE_COST         32
+
+/* 誤差拡散のスレッドプールの最大スレッド数 */
+#define P6_FS_POOL_MAX_THREADS  64
+
+/*
+ * 誤差拡散のスレッドプール（中身は直接触らないこと）
+ * 待っているワーカースレッドは条件変数で眠り、変換のたびに空いているものを借りる
+ * 複数のスレッドから同時に変換してもよく、空きが足りない分は呼び出し元のスレッドが処理する
+ */
+typedef struct p6_fs_pool p6_fs_pool_t;
+
+typedef struct {
+    p6_fs_pool_t *pool;
+    pthread_t thread;
+    pthread_cond_t wake;        /* task が来た・終了する */
+    void *task;                 /* 担当しているフレームのライン（空いていれば NULL） */
+} p6_fs_worker_t;
+
+struct p6_fs_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t progress;    /* ラインの処理が進んだ・フレームの担当分が終わった */
+    int nthreads;
+    int quit;
+    p6_fs_worker_t workers[P6_FS_POOL_MAX_THREADS];
+};
+
+/* 2値化・減色の方式 */
+enum {
+    P6_DITHER_NONE = 0,         /* 最近傍色・しきい値 */
+    P6_DITHER_FS,               /* Floyd-Steinberg 誤差拡散 */
+    P6_DITHER_BAYER4,           /* 4x4 Bayer 行列の組織的ディザ */
+    P6_DITHER_BAYER8,           /* 8x8 Bayer 行列の組織的ディザ */
+};
+
+/* 変換の設定 */
+typedef struct {
+    int mode;                   /* 3 か 4 */
+    int color_type;             /* SCREEN 3 のパレット (color ,,1 なら 1、color ,,2 なら 2) */
+    int xsize;                  /* 変換後の横ドット数 (1 ... P6_XSIZE) */
+    int ysize;                  /* 変換後の縦ドット数 (1 ... P6_YSIZE) */
+    int dither;                 /* P6_DITHER_* */
+    int frame_threads;          /* 誤差拡散で1フレームに使うスレッド数 (1 ... P6_MAX_FRAME_THREADS) */
+    p6_fs_pool_t *fs_pool;      /* frame_threads が 2 以上で使うスレッドプール（NULL なら呼び出し元のスレッドだけで処理） */
+} p6_config_t;
+
+/* LZ 符号化の作業領域（1フレーム分をウィンドウとして確保しておく） */
+#define P6_LZ_HASH_BITS 12
+#define P6_LZ_HASH_SIZE (1 << P6_LZ_HASH_BITS)
+
+typedef struct {
+    uint16_t head[P6_LZ_HASH_SIZE];     /* ハッシュごとの最新位置 */
+    uint16_t chain[P6_VRAM_SIZE];       /* 同じハッシュの1つ前の位置 */
+    uint8_t match_len[P6_VRAM_SIZE];    /* 各位置の最長一致長 */
+    uint16_t match_dist[P6_VRAM_SIZE];  /* その距離 */
+    uint32_t cost[P6_VRAM_SIZE + 1];    /* 各位置から最後までの最小コスト */
+    uint8_t step_len[P6_VRAM_SIZE];     /* 最小コストになる最初のトークンの長さ */
+    uint8_t step_match[P6_VRAM_SIZE];   /* そのトークンが一致なら真 */
+} p6_lzwork_t;
+
+/*
+ * 最近傍色テーブル等を作り、変換処理の実装を選ぶ
+ * kernel_name が NULL なら使える中で最も速いもの ("scalar", "sse2", "avx2")
+ * 指定した実装が使えない場合は -1
+ */
+int p6_init(const char *kernel_name);
+
+/*
+ * 誤差拡散のスレッドプールに nthreads (1 ... P6_FS_POOL_MAX_THREADS) 個のスレッドを作る
+ * 1つも作れなければ -1（作れた数は少なくてもよい）
+ * 使い終わったら変換中でないときに p6_fs_pool_destroy() で止める
+ */
+int p6_fs_pool_init(p6_fs_pool_t *pool, int nthreads);
+void p6_fs_pool_destroy(p6_fs_pool_t *pool);
+
+/* 選ばれた変換処理の実装の名前 */
+const char *p6_kernel_name(void);
+
+/* 変換後のVRAMデータのバイト数（1ラインのバイト数 x ysize） */
+size_t p6_vram_size(int mode, int xsize, int ysize);
+
+/*
+ * width x height の入力画像をそのまま変換できるか調べる
+ * 変換後の大きさと同じなら 0、SCREEN 3 で横が半分（元画像1ドットを出力1ドットにする）なら 1、
+ * どちらでもなければ -1（p6_scale() で縮小・拡大してから変換する）
+ */
+int p6_check_size(const p6_config_t *cf, int width, int height);
+
+/*
+ * 画像を VRAMデータにして out (p6_vram_size() バイト) に書く
+ * 入力画像の大きさは p6_check_size() が 0 か 1 になるもの
+ * SCREEN 3 は RGB のみ、SCREEN 4 はグレースケールも可
+ * 横幅が出力のバイト境界に揃わない場合、右端の余りのドットは黒として扱う
+ * 引数がおかしい場合は -1
+ */
+int p6_convert(const p6_config_t *cf, const uint8_t *pixels, int width,
+  int height, int stride, int channels, uint8_t *out);
+
+/* RGB の w x h の画像を color ,,1 のディザなしで SCREEN 3 / SCREEN 4 にする */
+int p6_convert_screen3(const uint8_t *rgb, int w, int h, int stride,
+  uint8_t *out);
+int p6_convert_screen4(const uint8_t *rgb, int w, int h, int stride,
+  uint8_t *out);
+
+/*
+ * パレット番号の画像をパレットの各色ごとの変換結果を引いて変換する
+ * 結果は RGB に広げて p6_convert() を使った場合と同じ
+ * 使えるのはディザなしの SCREEN 3 と誤差拡散以外の SCREEN 4 で、
+ * 大きさは縮小・拡大なしのもの（それ以外は -1 を返すので RGB に広げて変換する）
+ * SCREEN 3 の横2ドットの組の変換結果は pair (P6_PAIR_TABLE_SIZE バイト) に覚える
+ */
+int p6_convert_indexed(const p6_config_t *cf, const uint8_t *pixels,
+  int width, int height, int stride, const uint8_t (*palette)[3],
+  int ncolors, uint8_t *pair, uint8_t *out);
+
+/*
+ * width x height の画像を面積平均で xsize x ysize に縮小・拡大して dst に書く
+ * （dst は1ライン xsize * channels バイトで詰める）
+ * work には p6_scale_work_size() バイトの作業領域を渡す
+ */
+size_t p6_scale_work_size(int width, int height, int channels, int xsize,
+  int ysize);
+int p6_scale(const uint8_t *src, int width, int height, int stride,
+  int channels, uint8_t *dst, int xsize, int ysize, void *work);
+
+/*
+ * VRAMデータの符号化（形式は README 参照）
+ * 符号化は out に書いたバイト数（最大 P6_CODE_BUF_SIZE）を返す
+ * 復号は読んだバイト数を返す（データが壊れている場合は -1）
+ */
+size_t p6_delta_encode(const uint8_t *prev, const uint8_t *cur, size_t size,
+  uint8_t *out);
+long p6_delta_decode(uint8_t *frame, size_t size, const uint8_t *in,
+  size_t insize);
+size_t p6_rle_encode(const uint8_t *in, size_t size, uint8_t *out);
+long p6_rle_decode(uint8_t *out, size_t size, const uint8_t *in,
+  size_t insize);
+size_t p6_lz_encode(p6_lzwork_t *lz, const uint8_t *in, size_t size,
+  uint8_t *out, unsigned int byte_cost);
+long p6_lz_decode(uint8_t *out, size_t size, const uint8_t *in,
+  size_t insize);
+
+/* 高速化用のテーブルや各実装が総当たり計算と一致するか検査して結果を表示する */
+int p6_selftest(void);
+
+#endif /* IMG2P6_H */
@@ -21,8 +21,24 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* USE_IO_URING を定義してビルドすると一括変換のファイル入出力に io_uring を使う */
+#if defined(USE_IO_URING) && defined(__linux__)
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_PSD
@@ -33,124 +49,3212 @@
 #define STBI_NO_LINEAR
 #include "stb_image.h"
 
-#define IMG_XSIZE       256
-#define IMG_YSIZE       192
+#include "img2p6.h"
+
+#define MAX_THREADS     256
+
+/* 標準入力・ストリームの読み込み単位 */
+#define STREAM_CHUNK    (64 * 1024)
+
+/* 変換前のヘッダの検査で各入力ファイルの先頭から読む大きさ */
+#define PREFLIGHT_HEAD  4096
+
+/* 生フレーム列の入力で1度に読み込む大きさ（この中に入るだけのフレームをまとめて読む） */
+#define RAW_BLOCK_SIZE  (1024 * 1024)
+#define RAW_MAX_SIZE    16384           /* -r の WxH の上限 */
+
+/* ロングオプション */
+enum {
+    OPT_SELFTEST = 0x100,
+    OPT_KERNEL,
+    OPT_BENCH,
+    OPT_VERIFY,
+    OPT_LZ_BYTE_COST,
+    OPT_FRAME_THREADS,
+    OPT_FIT,
+    OPT_NO_MMAP,
+    OPT_NO_IO_URING,
+};
+
+/*
+ * 出力フレームの符号化方式（値はコンテナヘッダにもそのまま書く）
+ * ENC_DELTA は直前のフレーム（最初は全て 0 のフレーム）からの差分で、
+ * 変化したバイト列ごとに「長さ(1バイト) オフセット(2バイト) データ」を並べ、
+ * 長さ 0 で終わる
+ * ENC_RLE は制御バイト c に続けて、c が 1 ... 127 なら c バイトのリテラル、
+ * c が 0x80 以上なら次の1バイトを (c & 0x7f) + 2 回繰り返し、c = 0 で終わる
+ * ENC_LZ は制御バイト c に続けて、c が 1 ... 127 なら c バイトのリテラル、
+ * c が 0x80 以上なら続く2バイトの距離だけ前から (c & 0x7f) + 3 バイトコピーし、
+ * c = 0 で終わる
+ */
+enum {
+    ENC_RAW = 0,
+    ENC_DELTA = 1,
+    ENC_RLE = 2,
+    ENC_LZ = 3,
+};
+
+/*
+ * マルチフレームコンテナ
+ * ヘッダ (CONTAINER_HEADER_SIZE バイト) の後にフレームごとのファイル先頭からの
+ * オフセットを (フレーム数 + 1) 個並べ、その後にフレームのデータを並べる
+ * フラグに CONTAINER_FLAG_DELAYS があればオフセット表の後に
+ * フレームごとの表示時間（ミリ秒、16ビット）をフレーム数個並べる
+ * 数値は全てリトルエンディアン
+ */
+#define CONTAINER_MAGIC         "P6VC"
+#define CONTAINER_VERSION       1
+#define CONTAINER_HEADER_SIZE   20
+#define CONTAINER_FLAG_DELAYS   0x0001
+
+/*
+ * 入力画像の大きさの上限（ドット数）
+ * --fit でも変換前のヘッダの検査でこれより大きい画像は断る
+ */
+#define MAX_INPUT_PIXELS        (8192 * 8192)
+
+/*
+ * 一括変換のパイプラインのキューの長さ
+ * 先読みする入力ファイルと書き出し待ちのフレームはそれぞれ最大これだけ
+ * （とワーカースレッドが処理中の分）なので、ファイル数によらずメモリ使用量は一定
+ */
+#define PIPELINE_DEPTH  4
+
+/* io_uring で1度にまとめて送るファイル数 */
+#define URING_BATCH     16
+
+/* ベンチマークの既定の繰り返し回数 */
+#define BENCH_COUNT     1000
+
+const char progname[] = "img2p6screen3";
+
+/* 変換オプション */
+typedef struct {
+    int mode;
+    int color_type;
+    int img_xsize;
+    int img_ysize;
+    int encoding;               /* 出力フレームの符号化方式 (ENC_*) */
+    int verify;                 /* 符号化したフレームを復号して検証する */
+    int lz_byte_cost;           /* LZ 最適解析で圧縮データ1バイトを何Tステートとみなすか */
+    int dither;                 /* 2値化・減色の方式 (P6_DITHER_*) */
+    int frame_threads;          /* 誤差拡散で1フレームに使うスレッド数 */
+    p6_fs_pool_t *fs_pool;      /* その2番目以降のスレッド（NULL なら1スレッドで処理） */
+    int fit;                    /* サイズの違う画像を縮小・拡大して変換する */
+    int animation;              /* アニメーションGIFの全フレームを変換する */
+    int mmap_input;             /* 入力ファイルを mmap で読む */
+    int io_uring;               /* 一括変換のファイル入出力に io_uring を使う */
+} convopt_t;
+
+/*
+ * メモリに読み込んだ入力ファイル
+ * 通常のファイルは mmap し、パイプや特殊ファイル（と mmap できない場合）は
+ * read で読んで malloc したバッファに入れる
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int mapped;                 /* data は mmap した領域 */
+} input_t;
+
+/* 生フレーム列の入力形式 (-r) */
+typedef struct {
+    int channels;               /* 1ドットあたりのバイト数 (rgb24 は 3、gray8 は 1) */
+    int width;
+    int height;
+} rawfmt_t;
+
+/* 変換済みフレームの並び（マルチフレームコンテナ用） */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t maxsize;
+    size_t *ends;               /* 各フレームの data 内での終端位置 */
+    uint16_t *delays;           /* 各フレームの表示時間（ミリ秒） */
+    size_t nframes;
+    size_t maxframes;
+} framelist_t;
+
+/* 符号化の状態（差分符号化のために直前のフレームを覚えておく） */
+typedef struct {
+    int method;
+    int verify;
+    int lz_byte_cost;
+    unsigned long nframes;
+    uint8_t prev[P6_VRAM_SIZE];
+    uint8_t work[P6_VRAM_SIZE];
+    uint8_t out[P6_CODE_BUF_SIZE];
+    p6_lzwork_t lz;
+} encoder_t;
+
+/*
+ * バッチ変換の入出力ファイル組
+ * ofname が NULL の場合は変換結果を frames に貯めてコンテナに書く
+ */
+typedef struct {
+    char *ifname;
+    char *ofname;
+    framelist_t frames;
+    int failed;
+} job_t;
+
+typedef struct {
+    job_t *jobs;
+    size_t njobs;
+    size_t maxjobs;
+} joblist_t;
+
+/* パイプラインの段の間のキュー（容量 PIPELINE_DEPTH のリングバッファ） */
+typedef struct {
+    void *items[PIPELINE_DEPTH];
+    size_t head;
+    size_t count;
+    int closed;                 /* これ以上入れない */
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+} queue_t;
+
+/*
+ * 一括変換のパイプライン
+ * 読み込み（呼び出し元のスレッド）→ デコード・変換・符号化（ワーカースレッド）→
+ * 書き出し（書き出しスレッド）の各段をキューでつなぐ
+ */
+typedef struct {
+    const convopt_t *opt;
+    joblist_t *jl;
+    queue_t inputs;             /* 読み込み済みの入力 (inputitem_t) */
+    queue_t outputs;            /* 書き出し待ちのフレーム (outputitem_t) */
+    int async_write;            /* 書き出しスレッドがある */
+} pipeline_t;
+
+typedef struct {
+    job_t *job;
+    input_t in;
+} inputitem_t;
+
+typedef struct {
+    job_t *job;                 /* 書き出しに失敗したら failed を立てる */
+    char *ofname;
+    size_t size;
+    uint8_t data[];             /* 後ろに ofname が続く */
+} outputitem_t;
+
+static void
+usage(void)
+{
+    fprintf(stderr, "使い方: %s [-m 3|4] [-c 1|2] [-x xsize] [-y ysize] 入力画像ファイル 出力バイナリファイル\n", progname);
+    fprintf(stderr, "        %s [オプション] -b 入力画像ファイル 出力バイナリファイル ...\n", progname);
+    fprintf(stderr, "        %s [オプション] -l リストファイル\n", progname);
+    fprintf(stderr, "        %s [オプション] -S 入力ストリーム 出力ストリーム\n", progname);
+    fprintf(stderr, "        %s [オプション] -r 形式[:横x縦] 入力ストリーム 出力ストリーム\n", progname);
+    fprintf(stderr, "  ファイル名 - は標準入力・標準出力\n");
+    fprintf(stderr, "  -m 3     screen3 画像VRAM ※デフォルト\n");
+    fprintf(stderr, "  -m 4     screen4 画像VRAM\n");
+    fprintf(stderr, "  -c 1     color,,1 パレット（緑・黄・青・赤）※デフォルト\n");
+    fprintf(stderr, "  -c 2     color,,2 パレット（白・シアン・マゼンタ・橙）\n");
+    fprintf(stderr, "  -x xsize 画像の横サイズ xsize ドットのデータを作成\n");
+    fprintf(stderr, "  -y ysize 画像の縦サイズ ysize ドットのデータを作成\n");
+    fprintf(stderr, "  -b       入力画像ファイルと出力バイナリファイルの組を複数指定して一括変換\n");
+    fprintf(stderr, "  -l list  list に書かれた入力・出力ファイルの組を一括変換（- は標準入力）\n");
+    fprintf(stderr, "  -j jobs  一括変換を jobs 個のスレッドで並列に実行（0 は CPU数）\n");
+    fprintf(stderr, "  -a       アニメーションGIFの全フレームを変換（出力ファイル名は %%d にフレーム番号が入る書式）\n");
+    fprintf(stderr, "  -S       連結された画像 (PNG/BMP/JPEG/GIF) を順に変換してVRAMデータを連結出力\n");
+    fprintf(stderr, "  -r fmt[:WxH] 大きさ WxH（省略時は -x/-y）の生フレーム (rgb24, gray8) の連続を変換\n");
+    fprintf(stderr, "  -C file  全フレームを1つのマルチフレームコンテナ file に出力（引数は入力画像のみ）\n");
+    fprintf(stderr, "  -z enc   出力フレームの符号化方式 (none, delta, rle, lz) delta は -C, -S, -r と併用\n");
+    fprintf(stderr, "  --verify 符号化したフレームをその場で復号して元と一致するか検証\n");
+    fprintf(stderr, "  --lz-byte-cost=T -z lz で圧縮データ1バイトを展開時間 T ステート相当とみなす（既定 %d）\n", P6_LZ_BYTE_COST);
+    fprintf(stderr, "  -d dither 減色・2値化の方式 (none, fs, bayer4, bayer8)\n");
+    fprintf(stderr, "           fs は Floyd-Steinberg 誤差拡散、bayer4/bayer8 は組織的ディザ\n");
+    fprintf(stderr, "  --fit    入力画像のサイズが違う場合は面積平均で縮小・拡大して変換\n");
+    fprintf(stderr, "  --no-mmap 入力ファイルを mmap せずに read で読む\n");
+    fprintf(stderr, "  --no-io-uring 一括変換のファイル入出力に io_uring を使わない\n");
+    fprintf(stderr, "  --frame-threads=N 誤差拡散を1フレームあたり N スレッドで行う（最大 %d）\n", P6_MAX_FRAME_THREADS);
+    fprintf(stderr, "  --selftest 高速化テーブル等が総当たり計算と一致するか検査\n");
+    fprintf(stderr, "  --kernel=name 変換処理の実装を指定 (scalar, sse2, avx2)\n");
+    fprintf(stderr, "  --bench[=count] [入力画像ファイル] 各段階の処理時間を count 回計測\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+add_job(joblist_t *jl, const char *ifname, const char *ofname)
+{
+    job_t *job;
+
+    if (jl->njobs == jl->maxjobs) {
+        size_t maxjobs = jl->maxjobs == 0 ? 64 : jl->maxjobs * 2;
+        job_t *jobs = realloc(jl->jobs, maxjobs * sizeof(job_t));
+        if (jobs == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            exit(EXIT_FAILURE);
+        }
+        jl->jobs = jobs;
+        jl->maxjobs = maxjobs;
+    }
+    job = &jl->jobs[jl->njobs];
+    memset(job, 0, sizeof(*job));
+    job->ifname = strdup(ifname);
+    job->ofname = ofname != NULL ? strdup(ofname) : NULL;
+    if (job->ifname == NULL || (ofname != NULL && job->ofname == NULL)) {
+        fprintf(stderr, "メモリが足りません\n");
+        exit(EXIT_FAILURE);
+    }
+    jl->njobs++;
+}
+
+/*
+ * リストファイルを読み込む
+ * 1行に「入力画像ファイル 出力バイナリファイル」を空白区切りで書く
+ * （with_output が偽なら入力画像ファイルだけを書く）
+ * 空行と # で始まる行は無視する
+ */
+static int
+read_manifest(joblist_t *jl, const char *listname, int with_output)
+{
+    FILE *lfp;
+    char *line = NULL;
+    size_t linesize = 0;
+    unsigned long lineno = 0;
+    int rv = 0;
+
+    if (strcmp(listname, "-") == 0) {
+        lfp = stdin;
+    } else {
+        lfp = fopen(listname, "r");
+        if (lfp == NULL) {
+            fprintf(stderr, "リストファイルを開けませんでした: %s\n", listname);
+            return -1;
+        }
+    }
+
+    while (getline(&line, &linesize, lfp) != -1) {
+        static const char sep[] = " \t\r\n";
+        char *ifname, *ofname, *extra, *last;
+
+        lineno++;
+        ifname = strtok_r(line, sep, &last);
+        if (ifname == NULL || ifname[0] == '#')
+            continue;
+        ofname = with_output ? strtok_r(NULL, sep, &last) : NULL;
+        extra = strtok_r(NULL, sep, &last);
+        if ((with_output && ofname == NULL) || extra != NULL) {
+            fprintf(stderr, "リストファイルの書式が不正です: %s:%lu\n",
+              listname, lineno);
+            rv = -1;
+            break;
+        }
+        add_job(jl, ifname, ofname);
+    }
+    if (rv == 0 && ferror(lfp)) {
+        fprintf(stderr, "リストファイルの読み込みに失敗しました: %s\n", listname);
+        rv = -1;
+    }
+
+    free(line);
+    if (lfp != stdin)
+        fclose(lfp);
+    return rv;
+}
+
+/* フレームを1枚追加する（delay は表示時間のミリ秒、アニメーションGIF以外は 0） */
+static int
+framelist_add(framelist_t *fl, const uint8_t *data, size_t size,
+  unsigned int delay)
+{
+
+    if (fl->nframes == fl->maxframes) {
+        size_t maxframes = fl->maxframes == 0 ? 16 : fl->maxframes * 2;
+        size_t *ends;
+        uint16_t *delays;
+        ends = realloc(fl->ends, maxframes * sizeof(size_t));
+        if (ends == NULL)
+            return -1;
+        fl->ends = ends;
+        delays = realloc(fl->delays, maxframes * sizeof(uint16_t));
+        if (delays == NULL)
+            return -1;
+        fl->delays = delays;
+        fl->maxframes = maxframes;
+    }
+    if (fl->size + size > fl->maxsize) {
+        size_t maxsize = fl->maxsize == 0 ? 16 * P6_VRAM_SIZE : fl->maxsize;
+        uint8_t *ndata;
+        while (maxsize < fl->size + size)
+            maxsize *= 2;
+        ndata = realloc(fl->data, maxsize);
+        if (ndata == NULL)
+            return -1;
+        fl->data = ndata;
+        fl->maxsize = maxsize;
+    }
+    memcpy(fl->data + fl->size, data, size);
+    fl->size += size;
+    fl->delays[fl->nframes] = (uint16_t)delay;
+    fl->ends[fl->nframes++] = fl->size;
+    return 0;
+}
+
+static inline const uint8_t *
+framelist_frame(const framelist_t *fl, size_t i, size_t *sizep)
+{
+    size_t start = i == 0 ? 0 : fl->ends[i - 1];
+
+    *sizep = fl->ends[i] - start;
+    return fl->data + start;
+}
+
+static void
+framelist_free(framelist_t *fl)
+{
+
+    free(fl->data);
+    free(fl->ends);
+    free(fl->delays);
+    memset(fl, 0, sizeof(*fl));
+}
+
+static inline void
+put_le16(uint8_t *p, uint32_t v)
+{
+
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static inline void
+put_le32(uint8_t *p, uint32_t v)
+{
+
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static void
+encoder_init(encoder_t *enc, const convopt_t *opt)
+{
+
+    enc->method = opt->encoding;
+    enc->verify = opt->verify;
+    enc->lz_byte_cost = opt->lz_byte_cost;
+    enc->nframes = 0;
+    memset(enc->prev, 0, sizeof(enc->prev));
+}
+
+/*
+ * 1フレームを符号化する
+ * 結果は *outp（enc 内のバッファか vram そのもの）に入る
+ */
+static int
+encode_frame(encoder_t *enc, const char *name, const uint8_t *vram,
+  size_t size, const uint8_t **outp, size_t *outsizep)
+{
+    const uint8_t *out = vram;
+    size_t outsize = size;
+    long consumed;
+
+    switch (enc->method) {
+    case ENC_DELTA:
+        outsize = p6_delta_encode(enc->prev, vram, size, enc->out);
+        out = enc->out;
+        if (enc->verify) {
+            memcpy(enc->work, enc->prev, size);
+            consumed = p6_delta_decode(enc->work, size, out, outsize);
+            if (consumed != (long)outsize ||
+              memcmp(enc->work, vram, size) != 0) {
+                fprintf(stderr, "検証エラー: %s の差分符号化結果が元と一致しません\n",
+                  name);
+                return -1;
+            }
+        }
+        memcpy(enc->prev, vram, size);
+        break;
+    case ENC_RLE:
+        outsize = p6_rle_encode(vram, size, enc->out);
+        out = enc->out;
+        if (enc->verify) {
+            consumed = p6_rle_decode(enc->work, size, out, outsize);
+            if (consumed != (long)outsize ||
+              memcmp(enc->work, vram, size) != 0) {
+                fprintf(stderr, "検証エラー: %s のランレングス符号化結果が元と一致しません\n",
+                  name);
+                return -1;
+            }
+        }
+        break;
+    case ENC_LZ:
+        outsize = p6_lz_encode(&enc->lz, vram, size, enc->out,
+          (unsigned int)enc->lz_byte_cost);
+        out = enc->out;
+        if (enc->verify) {
+            consumed = p6_lz_decode(enc->work, size, out, outsize);
+            if (consumed != (long)outsize ||
+              memcmp(enc->work, vram, size) != 0) {
+                fprintf(stderr, "検証エラー: %s の LZ 符号化結果が元と一致しません\n",
+                  name);
+                return -1;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    enc->nframes++;
+    *outp = out;
+    *outsizep = outsize;
+    return 0;
+}
+
+/* マルチフレームコンテナを書き出す */
+static int
+write_container(const char *ofname, const convopt_t *opt,
+  const framelist_t *fl)
+{
+    uint8_t header[CONTAINER_HEADER_SIZE];
+    uint8_t *offsets;
+    size_t table_size, offset, i;
+    FILE *ofp;
+    int rv = -1;
+
+    /* アニメーションGIFの変換なら表示時間の表もオフセット表に続けて書く */
+    table_size = (fl->nframes + 1) * 4;
+    if (opt->animation)
+        table_size += fl->nframes * 2;
+    if (fl->nframes > UINT32_MAX / 8 ||
+      CONTAINER_HEADER_SIZE + table_size + fl->size > UINT32_MAX) {
+        fprintf(stderr, "コンテナが大きすぎます: %s\n", ofname);
+        return -1;
+    }
+    offsets = malloc(table_size);
+    if (offsets == NULL) {
+        fprintf(stderr, "メモリが足りません\n");
+        return -1;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(&header[0], CONTAINER_MAGIC, 4);
+    header[4] = CONTAINER_VERSION;
+    header[5] = (uint8_t)opt->mode;
+    header[6] = (uint8_t)opt->color_type;
+    header[7] = (uint8_t)opt->encoding;
+    put_le16(&header[8], (uint32_t)opt->img_xsize);
+    put_le16(&header[10], (uint32_t)opt->img_ysize);
+    put_le16(&header[12], (uint32_t)p6_vram_size(opt->mode, opt->img_xsize, 1));
+    put_le16(&header[14], opt->animation ? CONTAINER_FLAG_DELAYS : 0);
+    put_le32(&header[16], (uint32_t)fl->nframes);
+
+    offset = CONTAINER_HEADER_SIZE + table_size;
+    for (i = 0; i < fl->nframes; i++) {
+        put_le32(&offsets[i * 4], (uint32_t)offset);
+        offset += fl->ends[i] - (i == 0 ? 0 : fl->ends[i - 1]);
+    }
+    put_le32(&offsets[i * 4], (uint32_t)offset);
+    if (opt->animation) {
+        for (i = 0; i < fl->nframes; i++)
+            put_le16(&offsets[(fl->nframes + 1) * 4 + i * 2], fl->delays[i]);
+    }
+
+    if (strcmp(ofname, "-") == 0) {
+        ofp = stdout;
+    } else {
+        ofp = fopen(ofname, "wb");
+        if (ofp == NULL) {
+            fprintf(stderr, "出力ファイルを開けませんでした: %s\n", ofname);
+            goto out;
+        }
+    }
+    if (fwrite(header, 1, sizeof(header), ofp) != sizeof(header) ||
+      fwrite(offsets, 1, table_size, ofp) != table_size ||
+      fwrite(fl->data, 1, fl->size, ofp) != fl->size) {
+        fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+        if (ofp != stdout)
+            fclose(ofp);
+        goto out;
+    }
+    if (ofp == stdout ? fflush(ofp) != 0 : fclose(ofp) != 0) {
+        fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+        goto out;
+    }
+    rv = 0;
+
+ out:
+    free(offsets);
+    return rv;
+}
+
+/*
+ * 入出力で発行したシステムコールの数（ベンチマークで入出力の方式を比べる用）
+ * 通常のファイルの読み込み・書き出しの分だけ数える
+ */
+static atomic_ulong nsyscalls;
+
+static inline void
+count_syscalls(unsigned long n)
+{
+
+    atomic_fetch_add_explicit(&nsyscalls, n, memory_order_relaxed);
+}
+
+/* 変換済みVRAMデータをまとめて書き出す（"-" は標準出力） */
+static int
+write_vram(const char *ofname, const uint8_t *vram, size_t size)
+{
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    if (strcmp(ofname, "-") == 0) {
+        if (fwrite(vram, 1, size, stdout) != size || fflush(stdout) != 0) {
+            fprintf(stderr, "標準出力への書き込みに失敗しました\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    count_syscalls(1);
+    if (fd == -1) {
+        fprintf(stderr, "出力ファイルを開けませんでした: %s\n", ofname);
+        return -1;
+    }
+    for (done = 0; done < size; done += n) {
+        n = write(fd, vram + done, size - done);
+        count_syscalls(1);
+        if (n == -1 && errno == EINTR) {
+            n = 0;
+        } else if (n <= 0) {
+            fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+            close(fd);
+            return -1;
+        }
+    }
+    count_syscalls(1);
+    if (close(fd) != 0) {
+        fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+        return -1;
+    }
+    return 0;
+}
+
+/* ストリームを最後まで読み込む */
+static uint8_t *
+read_stream(int fd, size_t *sizep)
+{
+    uint8_t *buf = NULL, *nbuf;
+    size_t bufsize = 0, len = 0;
+    ssize_t n;
+
+    for (;;) {
+        if (len == bufsize) {
+            bufsize = bufsize == 0 ? STREAM_CHUNK : bufsize * 2;
+            nbuf = realloc(buf, bufsize);
+            if (nbuf == NULL) {
+                free(buf);
+                return NULL;
+            }
+            buf = nbuf;
+        }
+        n = read(fd, buf + len, bufsize - len);
+        count_syscalls(1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            free(buf);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    *sizep = len;
+    return buf;
+}
+
+/* ビッグエンディアン・リトルエンディアンの32ビット値 */
+static inline uint32_t
+get_be32(const uint8_t *p)
+{
+
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+      ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t
+get_le32(const uint8_t *p)
+{
+
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) |
+      ((uint32_t)p[1] << 8) | p[0];
+}
+
+/* GIF のサブブロック列を読み飛ばす */
+static size_t
+skip_gif_subblocks(const uint8_t *buf, size_t len, size_t pos)
+{
+
+    while (pos < len && buf[pos] != 0)
+        pos += buf[pos] + 1;
+    return pos < len ? pos + 1 : 0;
+}
+
+/*
+ * 連結された画像ストリームの先頭1枚分の長さを求める
+ * 対応形式は PNG, BMP, JPEG, GIF
+ * データが足りない場合は 0、形式を判別できない場合は -1 を返す
+ */
+static long
+image_length(const uint8_t *buf, size_t len)
+{
+    static const uint8_t png_sig[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    size_t pos;
+
+    if (len < 16)
+        return 0;
+
+    if (memcmp(buf, png_sig, sizeof(png_sig)) == 0) {
+        /* IEND チャンクまで */
+        pos = sizeof(png_sig);
+        while (pos + 12 <= len) {
+            size_t chunk = (size_t)get_be32(&buf[pos]) + 12;
+            if (memcmp(&buf[pos + 4], "IEND", 4) == 0)
+                return pos + chunk <= len ? (long)(pos + chunk) : 0;
+            pos += chunk;
+        }
+        return 0;
+    }
+
+    if (buf[0] == 'B' && buf[1] == 'M') {
+        /* ファイルヘッダのファイルサイズ */
+        size_t size = get_le32(&buf[2]);
+        if (size < 14)
+            return -1;
+        return size <= len ? (long)size : 0;
+    }
+
+    if (buf[0] == 0xff && buf[1] == 0xd8) {
+        /* EOI マーカーまで（SOS の後はエントロピー符号化データを読み飛ばす） */
+        pos = 2;
+        while (pos + 4 <= len) {
+            uint8_t marker;
+            if (buf[pos] != 0xff)
+                return -1;
+            marker = buf[pos + 1];
+            if (marker == 0xff) {
+                pos++;
+                continue;
+            }
+            if (marker == 0xd9)
+                return (long)(pos + 2);
+            if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+                pos += 2;
+                continue;
+            }
+            pos += 2 + ((size_t)buf[pos + 2] << 8 | buf[pos + 3]);
+            if (marker == 0xda) {
+                while (pos + 1 < len && !(buf[pos] == 0xff &&
+                  buf[pos + 1] != 0x00 &&
+                  !(buf[pos + 1] >= 0xd0 && buf[pos + 1] <= 0xd7)))
+                    pos++;
+            }
+        }
+        return 0;
+    }
+
+    if (memcmp(buf, "GIF87a", 6) == 0 || memcmp(buf, "GIF89a", 6) == 0) {
+        /* トレイラー (0x3b) まで */
+        pos = 13;
+        if (buf[10] & 0x80)
+            pos += 3U << ((buf[10] & 0x07) + 1);
+        while (pos < len) {
+            switch (buf[pos]) {
+            case 0x21:  /* 拡張ブロック */
+                pos = skip_gif_subblocks(buf, len, pos + 2);
+                break;
+            case 0x2c:  /* イメージブロック */
+                if (pos + 10 >= len)
+                    return 0;
+                if (buf[pos + 9] & 0x80)
+                    pos += 3U << ((buf[pos + 9] & 0x07) + 1);
+                pos = skip_gif_subblocks(buf, len, pos + 11);
+                break;
+            case 0x3b:  /* トレイラー */
+                return (long)(pos + 1);
+            default:
+                return -1;
+            }
+            if (pos == 0)
+                return 0;
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * パレット画像の高速化
+ * パレット形式の PNG・GIF は stb_image で RGB に広げずにパレット番号のままデコードし、
+ * パレットの各色について一度だけ最近傍色・輝度を求めて変換する
+ * stb_image と結果が変わりうる画像（インターレース PNG、透明色以外の合成が要る GIF、
+ * パレットの範囲外の番号等）は NULL を返して stb_image でデコードする
+ */
+/* PNG のフィルタを外す（1ドット1バイト未満なので左隣は1バイト前） */
+static int
+png_unfilter(uint8_t *raw, size_t rowbytes, int height)
+{
+    uint8_t *prior = NULL;
+    int y;
+    size_t i;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *row = raw + y * (rowbytes + 1);
+        int filter = row[0];
+        row++;
+        for (i = 0; i < rowbytes; i++) {
+            int a = i > 0 ? row[i - 1] : 0;
+            int b = prior != NULL ? prior[i] : 0;
+            int c = (i > 0 && prior != NULL) ? prior[i - 1] : 0;
+            int p, pa, pb, pc;
+            switch (filter) {
+            case 0:
+                break;
+            case 1:
+                row[i] += a;
+                break;
+            case 2:
+                row[i] += b;
+                break;
+            case 3:
+                row[i] += (a + b) / 2;
+                break;
+            case 4:
+                p = a + b - c;
+                pa = abs(p - a);
+                pb = abs(p - b);
+                pc = abs(p - c);
+                row[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                break;
+            default:
+                return -1;
+            }
+        }
+        prior = row;
+    }
+    return 0;
+}
+
+/* パレット形式の PNG（インターレースなし、1/2/4/8ビット） */
+static uint8_t *
+decode_indexed_png(const uint8_t *buf, size_t size, int *width, int *height,
+  uint8_t palette[256][3], int *ncolors)
+{
+    static const uint8_t signature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    uint8_t *idat = NULL, *raw = NULL, *pixels = NULL, *nidat;
+    size_t pos = 8, idat_len = 0, rowbytes = 0;
+    int w = 0, h = 0, depth = 0, npal = 0, seen_iend = 0, raw_len;
+    int x, y;
+
+    if (size < 8 + 25 || memcmp(buf, signature, 8) != 0)
+        return NULL;
+    /* 最初は IHDR でパレット形式・インターレースなしのものだけ */
+    if (get_be32(buf + 8) != 13 || memcmp(buf + 12, "IHDR", 4) != 0)
+        return NULL;
+    w = (int)get_be32(buf + 16);
+    h = (int)get_be32(buf + 20);
+    depth = buf[24];
+    if (w <= 0 || h <= 0 || w > P6_XSIZE * 16 || h > P6_YSIZE * 16 ||
+      buf[25] != 3 || (depth != 1 && depth != 2 && depth != 4 && depth != 8) ||
+      buf[26] != 0 || buf[27] != 0 || buf[28] != 0)
+        return NULL;
+    pos = 8 + 25;
+
+    while (!seen_iend) {
+        uint32_t len;
+        const uint8_t *type, *data;
+        if (size - pos < 12)
+            goto fail;
+        len = get_be32(buf + pos);
+        type = buf + pos + 4;
+        data = buf + pos + 8;
+        if (len > size - pos - 12)
+            goto fail;
+        if (memcmp(type, "PLTE", 4) == 0) {
+            if (len % 3 != 0 || len > 256 * 3 || idat != NULL)
+                goto fail;
+            npal = len / 3;
+            memcpy(palette, data, len);
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (npal == 0)
+                goto fail;
+            nidat = realloc(idat, idat_len + len);
+            if (nidat == NULL)
+                goto fail;
+            idat = nidat;
+            memcpy(idat + idat_len, data, len);
+            idat_len += len;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            seen_iend = 1;
+        } else if (!(type[0] & 0x20)) {
+            /* IHDR の重複や CgBI 等の知らない必須チャンクは stb_image に任せる */
+            goto fail;
+        }
+        pos += 12 + len;
+    }
+    if (idat == NULL)
+        goto fail;
+
+    rowbytes = ((size_t)w * depth + 7) / 8;
+    raw = (uint8_t *)stbi_zlib_decode_malloc_guesssize_headerflag(
+      (const char *)idat, (int)idat_len, (int)((rowbytes + 1) * h), &raw_len,
+      1);
+    if (raw == NULL || (size_t)raw_len != (rowbytes + 1) * h)
+        goto fail;
+    if (png_unfilter(raw, rowbytes, h) != 0)
+        goto fail;
+
+    pixels = malloc((size_t)w * h);
+    if (pixels == NULL)
+        goto fail;
+    for (y = 0; y < h; y++) {
+        const uint8_t *row = raw + y * (rowbytes + 1) + 1;
+        uint8_t *dst = pixels + (size_t)y * w;
+        int per_byte = 8 / depth, mask = (1 << depth) - 1;
+        for (x = 0; x < w; x++) {
+            int shift = 8 - depth * (x % per_byte + 1);
+            int index = (row[x / per_byte] >> shift) & mask;
+            if (index >= npal)
+                goto fail;
+            dst[x] = index;
+        }
+    }
+    free(idat);
+    free(raw);
+    *width = w;
+    *height = h;
+    *ncolors = npal;
+    return pixels;
+
+ fail:
+    free(idat);
+    free(raw);
+    free(pixels);
+    return NULL;
+}
+
+/*
+ * GIF の LZW を展開する（stb_image と同じ規則: 先頭にクリアコードが必要、
+ * 符号長は次に割り当てるコードが符号長の上限に達したら増やす）
+ * インターレースの場合は行を並べ替えながら書く
+ */
+typedef struct {
+    int16_t prefix;
+    uint8_t first;
+    uint8_t suffix;
+} gifcode_t;
+
+static int
+gif_lzw_decode(const uint8_t *buf, size_t size, size_t pos, int w, int h,
+  int interlaced, uint8_t *pixels)
+{
+    static const int pass_start[4] = { 0, 4, 2, 1 };
+    static const int pass_step[4] = { 8, 8, 4, 2 };
+    gifcode_t codes[8192];
+    uint8_t stack[8192];
+    int lzw_cs, clear, codesize, codemask, avail, oldcode, first;
+    int x = 0, y = 0, pass = 0, nrows = 0;
+    uint32_t bits = 0;
+    int valid_bits = 0, len = 0, i;
+
+    if (pos >= size)
+        return -1;
+    lzw_cs = buf[pos++];
+    if (lzw_cs > 12)
+        return -1;
+    clear = 1 << lzw_cs;
+    for (i = 0; i < clear; i++) {
+        codes[i].prefix = -1;
+        codes[i].first = i;
+        codes[i].suffix = i;
+    }
+    codesize = lzw_cs + 1;
+    codemask = (1 << codesize) - 1;
+    avail = clear + 2;
+    oldcode = -1;
+    first = 1;
+
+    for (;;) {
+        int code, n;
+        if (valid_bits < codesize) {
+            if (len == 0) {
+                if (pos >= size)
+                    return -1;
+                len = buf[pos++];
+                if (len == 0)
+                    break;
+            }
+            if (pos >= size)
+                return -1;
+            len--;
+            bits |= (uint32_t)buf[pos++] << valid_bits;
+            valid_bits += 8;
+            continue;
+        }
+        code = bits & codemask;
+        bits >>= codesize;
+        valid_bits -= codesize;
+        if (code == clear) {
+            codesize = lzw_cs + 1;
+            codemask = (1 << codesize) - 1;
+            avail = clear + 2;
+            oldcode = -1;
+            first = 0;
+            continue;
+        }
+        if (code == clear + 1)
+            break;
+        if (code > avail || first)
+            return -1;
+        if (oldcode >= 0) {
+            gifcode_t *p = &codes[avail++];
+            if (avail > 8192)
+                return -1;
+            p->prefix = oldcode;
+            p->first = codes[oldcode].first;
+            p->suffix = (code == avail) ? p->first : codes[code].first;
+        } else if (code == avail) {
+            return -1;
+        }
+
+        /* コードの並びは後ろから辿るので逆順に積んでから書く */
+        n = 0;
+        for (i = code; i >= 0; i = codes[i].prefix)
+            stack[n++] = codes[i].suffix;
+        while (n > 0 && nrows < h) {
+            pixels[(size_t)y * w + x] = stack[--n];
+            if (++x == w) {
+                x = 0;
+                nrows++;
+                y += interlaced ? pass_step[pass] : 1;
+                while (interlaced && y >= h && pass < 3) {
+                    pass++;
+                    y = pass_start[pass];
+                }
+            }
+        }
+
+        if ((avail & codemask) == 0 && avail <= 0x0fff) {
+            codesize++;
+            codemask = (1 << codesize) - 1;
+        }
+        oldcode = code;
+    }
+    /* 描かれなかったドットは背景色になるので stb_image に任せる */
+    return nrows == h ? 0 : -1;
+}
+
+/* GIF の最初のフレーム（画面全体を覆うもの） */
+static uint8_t *
+decode_indexed_gif(const uint8_t *buf, size_t size, int *width, int *height,
+  uint8_t palette[256][3], int *ncolors)
+{
+    uint8_t global[256][3];
+    uint8_t *pixels;
+    size_t pos, i;
+    int w, h, flags, nglobal = 0, transparent = -1, interlaced = 0;
+
+    if (size < 13 || (memcmp(buf, "GIF87a", 6) != 0 &&
+      memcmp(buf, "GIF89a", 6) != 0))
+        return NULL;
+    w = buf[6] | (buf[7] << 8);
+    h = buf[8] | (buf[9] << 8);
+    flags = buf[10];
+    pos = 13;
+    if (w == 0 || h == 0)
+        return NULL;
+    if (flags & 0x80) {
+        nglobal = 2 << (flags & 7);
+        if (size - pos < (size_t)nglobal * 3)
+            return NULL;
+        memcpy(global, buf + pos, nglobal * 3);
+        pos += nglobal * 3;
+    }
+
+    for (;;) {
+        if (pos >= size)
+            return NULL;
+        if (buf[pos] == 0x21) {
+            /* 拡張ブロック（Graphic Control Extension の透明色だけ見る） */
+            if (size - pos < 3)
+                return NULL;
+            if (buf[pos + 1] == 0xf9) {
+                /* 長さが 4 でないものは stb_image の読み方が特殊なので任せる */
+                if (buf[pos + 2] != 4 || size - pos < 8)
+                    return NULL;
+                transparent = (buf[pos + 3] & 0x01) ? buf[pos + 6] : -1;
+                pos += 7;
+            } else {
+                pos += 2;
+            }
+            pos = skip_gif_subblocks(buf, size, pos);
+            if (pos == 0)
+                return NULL;
+        } else if (buf[pos] == 0x2c) {
+            int x0, y0, fw, fh, lflags;
+            if (size - pos < 10)
+                return NULL;
+            x0 = buf[pos + 1] | (buf[pos + 2] << 8);
+            y0 = buf[pos + 3] | (buf[pos + 4] << 8);
+            fw = buf[pos + 5] | (buf[pos + 6] << 8);
+            fh = buf[pos + 7] | (buf[pos + 8] << 8);
+            lflags = buf[pos + 9];
+            interlaced = (lflags & 0x40) != 0;
+            pos += 10;
+            if (x0 != 0 || y0 != 0 || fw != w || fh != h)
+                return NULL;
+            if (lflags & 0x80) {
+                *ncolors = 2 << (lflags & 7);
+                if (size - pos < (size_t)*ncolors * 3)
+                    return NULL;
+                memcpy(palette, buf + pos, *ncolors * 3);
+                pos += *ncolors * 3;
+            } else if (nglobal > 0) {
+                *ncolors = nglobal;
+                memcpy(palette, global, nglobal * 3);
+            } else {
+                return NULL;
+            }
+            break;
+        } else {
+            return NULL;
+        }
+    }
+
+    pixels = malloc((size_t)w * h);
+    if (pixels == NULL)
+        return NULL;
+    if (gif_lzw_decode(buf, size, pos, w, h, interlaced, pixels) != 0)
+        goto fail;
+    for (i = 0; i < (size_t)w * h; i++) {
+        if (pixels[i] >= *ncolors)
+            goto fail;
+    }
+    /* stb_image は透明色のドットを描かないので黒のまま残る */
+    if (transparent >= 0 && transparent < *ncolors)
+        memset(palette[transparent], 0, 3);
+    *width = w;
+    *height = h;
+    return pixels;
+
+ fail:
+    free(pixels);
+    return NULL;
+}
+
+/* デコード済みの画像 */
+typedef struct {
+    uint8_t *pixels;            /* RGB、グレースケール、またはパレット番号 */
+    int width;
+    int height;
+    int channels;               /* 1ドットあたりのバイト数 (1 か 3) */
+    int indexed;                /* pixels はパレット番号 */
+    int ncolors;
+    uint8_t palette[256][3];
+} image_t;
+
+static void
+image_free(image_t *im)
+{
+
+    if (im->indexed)
+        free(im->pixels);
+    else
+        stbi_image_free(im->pixels);
+    im->pixels = NULL;
+}
+
+/*
+ * デコード後の1ドットあたりのバイト数
+ * SCREEN 4 で元画像がグレースケール（とアルファ）ならグレースケールのまま、
+ * それ以外は RGB にする
+ * グレースケールの値 v を RGB に広げると rgb_to_gray(v, v, v) == v なので結果は変わらない
+ * （RGB の画像を stb_image でグレースケールにする場合は係数が違うので使わない）
+ */
+static int
+decode_channels(int mode, int comp)
+{
+
+    return (mode == 4 && (comp == 1 || comp == 2)) ? 1 : 3;
+}
+
+/*
+ * メモリ上の画像をデコードする
+ * パレット形式の PNG・GIF はパレット番号のまま、それ以外は stb_image で
+ * 失敗した場合は -1 を返す（理由は stbi_failure_reason()）
+ */
+static int
+decode_image(const uint8_t *buf, size_t size, int mode, image_t *im)
+{
+    int comp;
+
+    im->channels = 1;
+    im->indexed = 1;
+    im->pixels = decode_indexed_png(buf, size, &im->width, &im->height,
+      im->palette, &im->ncolors);
+    if (im->pixels == NULL) {
+        im->pixels = decode_indexed_gif(buf, size, &im->width, &im->height,
+          im->palette, &im->ncolors);
+    }
+    if (im->pixels != NULL)
+        return 0;
+
+    im->indexed = 0;
+    if (!stbi_info_from_memory(buf, (int)size, &im->width, &im->height, &comp))
+        comp = 3;
+    im->channels = decode_channels(mode, comp);
+    im->pixels = stbi_load_from_memory(buf, (int)size, &im->width,
+      &im->height, &comp, im->channels);
+    return im->pixels != NULL ? 0 : -1;
+}
+
+/*
+ * 入力ファイルを mmap する（通常のファイルでなければ 1 を返すので read で読む）
+ * デコーダは先頭から順に読むので先読みを多めにしてもらう
+ */
+static int
+map_input(int fd, input_t *in)
+{
+    struct stat st;
+    void *p;
+
+    count_syscalls(1);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (uintmax_t)st.st_size > INT_MAX)
+        return 1;
+    count_syscalls(1);
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return 1;
+    count_syscalls(1);
+    madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+    in->data = p;
+    in->size = (size_t)st.st_size;
+    in->mapped = 1;
+    return 0;
+}
+
+/* 入力ファイル全体をメモリに読み込む（"-" は標準入力） */
+static int
+read_input(const char *ifname, int use_mmap, input_t *in)
+{
+    uint8_t *buf;
+    int fd = STDIN_FILENO;
+
+    in->mapped = 0;
+    if (strcmp(ifname, "-") != 0) {
+        fd = open(ifname, O_RDONLY);
+        count_syscalls(1);
+        if (fd == -1) {
+            fprintf(stderr, "入力ファイルを開けませんでした: %s\n", ifname);
+            return -1;
+        }
+        if (use_mmap && map_input(fd, in) == 0) {
+            count_syscalls(1);
+            close(fd);
+            return 0;
+        }
+    }
+    buf = read_stream(fd, &in->size);
+    if (fd != STDIN_FILENO) {
+        count_syscalls(1);
+        close(fd);
+    }
+    if (buf == NULL) {
+        fprintf(stderr, "入力の読み込みに失敗しました: %s\n",
+          fd != STDIN_FILENO ? ifname : "標準入力");
+        return -1;
+    }
+    in->data = buf;
+    return 0;
+}
+
+/*
+ * 読み込んだ入力ファイルを手放す
+ * mmap した領域はデコードが済めば要らないので、ページもすぐに返してもらう
+ */
+static void
+input_release(input_t *in)
+{
+
+    if (in->mapped) {
+        count_syscalls(2);
+        madvise((void *)in->data, in->size, MADV_DONTNEED);
+        munmap((void *)in->data, in->size);
+    } else {
+        free((void *)in->data);
+    }
+    in->data = NULL;
+}
+
+/* パレット番号の画像を RGB に広げる */
+static uint8_t *
+expand_indexed(const image_t *im)
+{
+    size_t n = (size_t)im->width * im->height, i;
+    uint8_t *rgb;
+
+    rgb = malloc(n * 3);
+    if (rgb == NULL)
+        return NULL;
+    for (i = 0; i < n; i++)
+        memcpy(&rgb[i * 3], im->palette[im->pixels[i]], 3);
+    return rgb;
+}
+
+/* 変換オプションからライブラリの変換の設定を作る */
+static void
+make_config(const convopt_t *opt, p6_config_t *cf)
+{
+
+    cf->mode = opt->mode;
+    cf->color_type = opt->color_type;
+    cf->xsize = opt->img_xsize;
+    cf->ysize = opt->img_ysize;
+    cf->dither = opt->dither;
+    cf->frame_threads = opt->frame_threads;
+    cf->fs_pool = opt->fs_pool;
+}
+
+/* デコード済みの画像を VRAM データにする */
+static int
+convert_image(const convopt_t *opt, const char *ifname, const image_t *im,
+  uint8_t *vram, size_t *vram_sizep)
+{
+    const uint8_t *img = im->pixels;
+    int width = im->width, height = im->height, channels = im->channels;
+    uint8_t *scaled = NULL, *expanded = NULL, *work = NULL;
+    p6_config_t cf;
+    int rv = -1;
+
+    make_config(opt, &cf);
+    if (p6_check_size(&cf, width, height) < 0 && !opt->fit) {
+        fprintf(stderr, "エラー: 入力画像のサイズは %dx%d である必要があります（%s の画像サイズ: %dx%d）\n",
+          cf.xsize, cf.ysize, ifname, width, height);
+        return -1;
+    }
+    *vram_sizep = p6_vram_size(cf.mode, cf.xsize, cf.ysize);
+
+    if (im->indexed) {
+        /* ディザや縮小・拡大で色が混ざらなければパレット番号のまま変換する */
+        if (p6_check_size(&cf, width, height) >= 0 &&
+          (cf.mode == 4 || cf.dither == P6_DITHER_NONE)) {
+            uint8_t *pair = NULL;
+            if (cf.mode == 3) {
+                pair = malloc(P6_PAIR_TABLE_SIZE);
+                if (pair == NULL) {
+                    fprintf(stderr, "メモリが足りません\n");
+                    return -1;
+                }
+            }
+            rv = p6_convert_indexed(&cf, im->pixels, width, height, width,
+              im->palette, im->ncolors, pair, vram);
+            free(pair);
+            if (rv == 0)
+                return 0;
+        }
+        expanded = expand_indexed(im);
+        if (expanded == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            return -1;
+        }
+        img = expanded;
+        channels = 3;
+    }
+
+    if (p6_check_size(&cf, width, height) < 0) {
+        scaled = malloc((size_t)cf.xsize * cf.ysize * channels);
+        work = malloc(p6_scale_work_size(width, height, channels, cf.xsize,
+          cf.ysize));
+        if (scaled == NULL || work == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            goto out;
+        }
+        p6_scale(img, width, height, width * channels, channels, scaled,
+          cf.xsize, cf.ysize, work);
+        img = scaled;
+        width = cf.xsize;
+        height = cf.ysize;
+    }
+
+    rv = p6_convert(&cf, img, width, height, width * channels, channels, vram);
+    if (rv != 0)
+        fprintf(stderr, "変換できませんでした: %s\n", ifname);
+out:
+    free(work);
+    free(scaled);
+    free(expanded);
+    return rv;
+}
+
+static void
+queue_init(queue_t *q)
+{
+
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->nonempty, NULL);
+    pthread_cond_init(&q->nonfull, NULL);
+}
+
+static void
+queue_destroy(queue_t *q)
+{
+
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->nonempty);
+    pthread_cond_destroy(&q->nonfull);
+}
+
+/* キューに入れる（いっぱいなら空くまで待つ） */
+static void
+queue_put(queue_t *q, void *item)
+{
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == PIPELINE_DEPTH)
+        pthread_cond_wait(&q->nonfull, &q->lock);
+    q->items[(q->head + q->count) % PIPELINE_DEPTH] = item;
+    q->count++;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* キューから取り出す（空なら待ち、閉じられて空なら NULL） */
+static void *
+queue_get(queue_t *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->nonempty, &q->lock);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % PIPELINE_DEPTH;
+        q->count--;
+        pthread_cond_signal(&q->nonfull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+#ifdef HAVE_IO_URING
+/* キューに入っていれば取り出す（空なら待たずに NULL） */
+static void *
+queue_tryget(queue_t *q)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % PIPELINE_DEPTH;
+        q->count--;
+        pthread_cond_signal(&q->nonfull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+#endif
+
+/* これ以上入れないことを待っている側に知らせる */
+static void
+queue_close(queue_t *q)
+{
+
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * mmap した入力のページを読み込んでおく
+ * 読み込みの段で済ませておけば、デコードするワーカースレッドはディスクを待たない
+ */
+static void
+prefetch_input(const input_t *in)
+{
+    const volatile uint8_t *p = in->data;
+    size_t pagesize, i;
+    uint8_t sum = 0;
+
+    if (!in->mapped)
+        return;
+    count_syscalls(1);
+    madvise((void *)in->data, in->size, MADV_WILLNEED);
+    pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    for (i = 0; i < in->size; i += pagesize)
+        sum += p[i];
+    (void)sum;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring による一括変換のファイル入出力
+ * liburing は使わず、システムコールを直接呼んで SQ/CQ のリングを mmap する
+ * 1つのリングは1つのスレッドだけが使う（読み込みの段と書き出しスレッドがそれぞれ持つ）
+ * 溜めた要求を uring_run() で1度に送って全部の完了を待つので、
+ * URING_BATCH ファイル分の open・read・write・close が数回の io_uring_enter で済む
+ */
+#define URING_ENTRIES   (URING_BATCH * 2)
+
+typedef struct {
+    int fd;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned int tail;          /* 次に書く SQE の位置 */
+    unsigned int pending;       /* 送っていない SQE の数 */
+} uring_t;
+
+/* 使う操作をカーネルが全部サポートしているか */
+static int
+uring_probe(int fd)
+{
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_CLOSE
+    };
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[IORING_OP_LAST];
+    } p;
+    size_t i;
+
+    memset(&p, 0, sizeof(p));
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &p,
+      IORING_OP_LAST) != 0)
+        return -1;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > p.probe.last_op ||
+          !(p.ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            return -1;
+    }
+    return 0;
+}
+
+/* リングを作る（io_uring が使えなければ -1） */
+static int
+uring_init(uring_t *u)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0)
+        return -1;
+    if (uring_probe(u->fd) != 0) {
+        close(u->fd);
+        return -1;
+    }
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->cq_ring = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+    u->pending = 0;
+    return 0;
+
+ fail:
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    return -1;
+}
+
+static void
+uring_free(uring_t *u)
+{
+
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+/* 次の SQE を取る（結果は uring_run() の res[user_data] に入る） */
+static struct io_uring_sqe *
+uring_sqe(uring_t *u, int opcode, int fd, unsigned int user_data)
+{
+    unsigned int index = u->tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    u->tail++;
+    u->pending++;
+    return sqe;
+}
+
+/* 溜めた SQE を全部送り、全部完了するまで待つ */
+static int
+uring_run(uring_t *u, int *res)
+{
+    unsigned int nwait = u->pending;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    while (nwait > 0) {
+        unsigned int head, tail;
+        int n;
+
+        n = (int)syscall(__NR_io_uring_enter, u->fd, u->pending, nwait,
+          IORING_ENTER_GETEVENTS, NULL, 0);
+        count_syscalls(1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        u->pending -= n;
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            res[cqe->user_data] = cqe->res;
+            nwait--;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*
+ * 入力ファイルをまとめて読み込む
+ * 1回目に全ファイルの statx、2回目に通常のファイルの open、3回目に read と
+ * それに続く close をまとめて送る（read が失敗しても close するように IOSQE_IO_HARDLINK でつなぐ）
+ * 標準入力や通常のファイルでないものは read_input() で読む
+ * head が 0 でなければ通常のファイルの先頭 head バイトまでだけを読み、
+ * 標準入力や通常のファイルでないものは読まずに data を NULL のままにする
+ * 読めなかったファイルは job->failed を立てる
+ */
+static void
+uring_read_inputs(uring_t *u, job_t *const *jobs, int n, input_t *in,
+  size_t head)
+{
+    struct statx stx[URING_BATCH];
+    int res[URING_BATCH * 2], fds[URING_BATCH], direct[URING_BATCH];
+    int skip[URING_BATCH];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        fds[i] = -1;
+        in[i].data = NULL;
+        in[i].mapped = 0;
+        direct[i] = strcmp(jobs[i]->ifname, "-") != 0;
+        skip[i] = head != 0 && !direct[i];
+        if (!direct[i])
+            continue;
+        sqe = uring_sqe(u, IORING_OP_STATX, AT_FDCWD, i);
+        sqe->addr = (uintptr_t)jobs[i]->ifname;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t)&stx[i];
+    }
+    if (uring_run(u, res) != 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        if (!direct[i])
+            continue;
+        if (res[i] != 0 || !S_ISREG(stx[i].stx_mode) ||
+          (head == 0 && (stx[i].stx_size == 0 || stx[i].stx_size > INT_MAX))) {
+            /* statx できなければ read_input() でエラーを出す */
+            if (head != 0 && res[i] == 0)
+                skip[i] = 1;
+            direct[i] = 0;
+            continue;
+        }
+        if (head != 0 && stx[i].stx_size > head)
+            stx[i].stx_size = head;
+        sqe = uring_sqe(u, IORING_OP_OPENAT, AT_FDCWD, i);
+        sqe->addr = (uintptr_t)jobs[i]->ifname;
+        sqe->open_flags = O_RDONLY;
+    }
+    if (uring_run(u, res) != 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        uint8_t *buf;
+        if (!direct[i])
+            continue;
+        if (res[i] < 0) {
+            fprintf(stderr, "入力ファイルを開けませんでした: %s\n",
+              jobs[i]->ifname);
+            jobs[i]->failed = 1;
+            direct[i] = 0;
+            continue;
+        }
+        fds[i] = res[i];
+        /* 空のファイルも読んだことにする（デコードでエラーになる） */
+        buf = malloc(stx[i].stx_size > 0 ? (size_t)stx[i].stx_size : 1);
+        if (buf == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            jobs[i]->failed = 1;
+            direct[i] = 0;
+            close(fds[i]);
+            continue;
+        }
+        in[i].data = buf;
+        in[i].size = (size_t)stx[i].stx_size;
+        sqe = uring_sqe(u, IORING_OP_READ, fds[i], i * 2);
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = (unsigned int)stx[i].stx_size;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        uring_sqe(u, IORING_OP_CLOSE, fds[i], i * 2 + 1);
+    }
+    if (uring_run(u, res) != 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        if (direct[i] && res[i * 2] != (int)in[i].size) {
+            /* 途中で大きさが変わった場合も読み直さずに失敗とする */
+            fprintf(stderr, "入力の読み込みに失敗しました: %s\n",
+              jobs[i]->ifname);
+            jobs[i]->failed = 1;
+        } else if (!direct[i] && !skip[i] && !jobs[i]->failed &&
+          read_input(jobs[i]->ifname, 0, &in[i]) != 0) {
+            jobs[i]->failed = 1;
+        }
+        if (jobs[i]->failed)
+            input_release(&in[i]);
+    }
+    return;
+
+ fail:
+    /* io_uring_enter 自体が失敗するのはリングが壊れた場合のみ */
+    fprintf(stderr, "io_uring の入出力に失敗しました\n");
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        input_release(&in[i]);
+        jobs[i]->failed = 1;
+    }
+}
+
+/*
+ * 変換済みのフレームをまとめて書き出す
+ * 1回目に全ファイルの open、2回目に write とそれに続く close をまとめて送る
+ * 標準出力は write_vram() で書く
+ * 書き出せなかったファイルは job->failed を立てる
+ */
+static void
+uring_write_outputs(uring_t *u, outputitem_t *const *items, int n)
+{
+    int res[URING_BATCH * 2], fds[URING_BATCH];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        fds[i] = -1;
+        if (strcmp(items[i]->ofname, "-") == 0)
+            continue;
+        sqe = uring_sqe(u, IORING_OP_OPENAT, AT_FDCWD, i);
+        sqe->addr = (uintptr_t)items[i]->ofname;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->len = 0666;
+    }
+    if (uring_run(u, res) != 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe;
+        if (strcmp(items[i]->ofname, "-") == 0)
+            continue;
+        if (res[i] < 0) {
+            fprintf(stderr, "出力ファイルを開けませんでした: %s\n",
+              items[i]->ofname);
+            items[i]->job->failed = 1;
+            continue;
+        }
+        fds[i] = res[i];
+        sqe = uring_sqe(u, IORING_OP_WRITE, fds[i], i * 2);
+        sqe->addr = (uintptr_t)items[i]->data;
+        sqe->len = (unsigned int)items[i]->size;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        uring_sqe(u, IORING_OP_CLOSE, fds[i], i * 2 + 1);
+    }
+    if (uring_run(u, res) != 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0 && (res[i * 2] != (int)items[i]->size ||
+          res[i * 2 + 1] < 0)) {
+            fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n",
+              items[i]->ofname);
+            items[i]->job->failed = 1;
+        } else if (strcmp(items[i]->ofname, "-") == 0 &&
+          write_vram("-", items[i]->data, items[i]->size) != 0) {
+            items[i]->job->failed = 1;
+        }
+    }
+    return;
+
+ fail:
+    fprintf(stderr, "io_uring の入出力に失敗しました\n");
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        items[i]->job->failed = 1;
+    }
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * 変換したフレームを ofname に書き出す
+ * 書き出しスレッドがあればキューに入れて、書き出しを待たずに戻る
+ */
+static int
+pipeline_write(pipeline_t *pl, job_t *job, const char *ofname,
+  const uint8_t *data, size_t size)
+{
+    outputitem_t *item;
+
+    if (!pl->async_write)
+        return write_vram(ofname, data, size);
+    item = malloc(sizeof(*item) + size + strlen(ofname) + 1);
+    if (item == NULL) {
+        fprintf(stderr, "メモリが足りません\n");
+        return -1;
+    }
+    item->job = job;
+    item->size = size;
+    memcpy(item->data, data, size);
+    item->ofname = (char *)&item->data[size];
+    strcpy(item->ofname, ofname);
+    queue_put(&pl->outputs, item);
+    return 0;
+}
+
+/* 読み込んだ入力ファイルをデコードする */
+static int
+decode_input(const convopt_t *opt, const char *ifname, const input_t *in,
+  image_t *im)
+{
+
+    if (decode_image(in->data, in->size, opt->mode, im) != 0) {
+        fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+          strcmp(ifname, "-") != 0 ? ifname : "標準入力",
+          stbi_failure_reason());
+        return -1;
+    }
+    return 0;
+}
+
+/* 1ファイル分の変換（コンテナ出力の場合は job->frames に貯める） */
+static int
+convert_file(pipeline_t *pl, job_t *job, const input_t *in)
+{
+    const convopt_t *opt = pl->opt;
+    image_t im;
+    uint8_t vram[P6_VRAM_SIZE];
+    size_t vram_size;
+    int rv = -1;
+
+    if (decode_input(opt, job->ifname, in, &im) != 0)
+        return -1;
+
+    if (convert_image(opt, job->ifname, &im, vram, &vram_size) == 0) {
+        if (job->ofname != NULL || opt->encoding != ENC_DELTA) {
+            /* フレームごとに独立した符号化はワーカースレッドで済ませる */
+            encoder_t enc;
+            const uint8_t *out;
+            size_t outsize;
+            encoder_init(&enc, opt);
+            rv = encode_frame(&enc, job->ifname, vram, vram_size, &out,
+              &outsize);
+            if (rv == 0 && job->ofname != NULL) {
+                rv = pipeline_write(pl, job, job->ofname, out, outsize);
+            } else if (rv == 0) {
+                rv = framelist_add(&job->frames, out, outsize, 0);
+                if (rv != 0)
+                    fprintf(stderr, "メモリが足りません\n");
+            }
+        } else {
+            /* 差分符号化は全フレームが揃ってから入力順に行う */
+            rv = framelist_add(&job->frames, vram, vram_size, 0);
+            if (rv != 0)
+                fprintf(stderr, "メモリが足りません\n");
+        }
+    }
+
+    image_free(&im);
+    return rv;
+}
+
+/*
+ * 出力ファイル名の書式がフレーム番号を1つだけ埋め込むものか調べる
+ * 使えるのは %d（0埋めと桁数の指定は可）1つと %% のみ
+ */
+static int
+check_frame_pattern(const char *pattern)
+{
+    const char *p;
+    int nconv = 0;
+
+    for (p = pattern; *p != '\0'; p++) {
+        if (*p != '%')
+            continue;
+        p++;
+        if (*p == '%')
+            continue;
+        while (*p == '0')
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p != 'd')
+            return -1;
+        nconv++;
+    }
+    return nconv == 1 ? 0 : -1;
+}
+
+/*
+ * アニメーションGIFの全フレームを変換する
+ * job->ofname はフレーム番号を埋め込む書式で、フレームごとに別ファイルに書き出す
+ * （NULL ならコンテナ用に表示時間と一緒に job->frames に貯める）
+ * GIF 以外の画像は1フレームだけのアニメーションとして扱う
+ */
+static int
+convert_animation(pipeline_t *pl, job_t *job, const input_t *in)
+{
+    const convopt_t *opt = pl->opt;
+    uint8_t *frames = NULL;
+    int *delays = NULL;
+    size_t frame_size;
+    char name[PATH_MAX + 32], ofname[PATH_MAX];
+    encoder_t enc;
+    image_t im;
+    int nframes = 1, comp, i, rv = -1;
+
+    if (in->size >= 6 && memcmp(in->data, "GIF8", 4) == 0) {
+        /* 全フレームを重ね合わせ済みの RGB で1度にデコードする */
+        frames = stbi_load_gif_from_memory(in->data, (int)in->size, &delays,
+          &im.width, &im.height, &nframes, &comp, 3);
+        im.pixels = frames;
+        im.channels = 3;
+        im.indexed = 0;
+    } else if (decode_image(in->data, in->size, opt->mode, &im) != 0) {
+        im.pixels = NULL;
+    }
+    if (im.pixels == NULL) {
+        fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+          job->ifname, stbi_failure_reason());
+        return -1;
+    }
+    if (nframes == 0) {
+        fprintf(stderr, "画像にフレームがありません: %s\n", job->ifname);
+        goto out;
+    }
+
+    encoder_init(&enc, opt);
+    frame_size = (size_t)im.width * im.height * im.channels;
+    for (i = 0; i < nframes; i++) {
+        uint8_t vram[P6_VRAM_SIZE];
+        size_t vram_size, outsize;
+        const uint8_t *out;
+        unsigned int delay = 0;
+
+        if (frames != NULL) {
+            im.pixels = frames + frame_size * i;
+            delay = delays[i] < 0 ? 0 :
+              delays[i] > UINT16_MAX ? UINT16_MAX : (unsigned int)delays[i];
+        }
+        snprintf(name, sizeof(name), "%s のフレーム %d", job->ifname, i);
+        if (convert_image(opt, name, &im, vram, &vram_size) != 0)
+            goto out;
+        if (job->ofname == NULL && opt->encoding == ENC_DELTA) {
+            /* 差分符号化は全フレームが揃ってから入力順に行う */
+            if (framelist_add(&job->frames, vram, vram_size, delay) != 0) {
+                fprintf(stderr, "メモリが足りません\n");
+                goto out;
+            }
+            continue;
+        }
+        if (encode_frame(&enc, name, vram, vram_size, &out, &outsize) != 0)
+            goto out;
+        if (job->ofname == NULL) {
+            if (framelist_add(&job->frames, out, outsize, delay) != 0) {
+                fprintf(stderr, "メモリが足りません\n");
+                goto out;
+            }
+        } else {
+            snprintf(ofname, sizeof(ofname), job->ofname, i);
+            if (pipeline_write(pl, job, ofname, out, outsize) != 0)
+                goto out;
+        }
+    }
+    rv = 0;
+
+ out:
+    if (frames != NULL) {
+        stbi_image_free(frames);
+        free(delays);
+    } else {
+        image_free(&im);
+    }
+    return rv;
+}
+
+/*
+ * 連結された画像を順に読み込み、変換したVRAMデータを連結して書き出す
+ * （"-" は標準入力・標準出力）
+ * frames が NULL でなければ書き出さずに frames に貯める
+ */
+static int
+convert_stream(const convopt_t *opt, const char *ifname, const char *ofname,
+  framelist_t *frames)
+{
+    FILE *ifp = stdin, *ofp = stdout;
+    uint8_t *buf = NULL, *nbuf;
+    size_t bufsize = 0, len = 0, n;
+    unsigned long frame = 0;
+    char name[PATH_MAX + 32];
+    encoder_t enc;
+    int eof = 0, rv = -1;
+
+    encoder_init(&enc, opt);
+
+    if (strcmp(ifname, "-") != 0) {
+        ifp = fopen(ifname, "rb");
+        if (ifp == NULL) {
+            fprintf(stderr, "入力ファイルを開けませんでした: %s\n", ifname);
+            return -1;
+        }
+    }
+    if (frames != NULL) {
+        ofp = NULL;
+    } else if (strcmp(ofname, "-") != 0) {
+        ofp = fopen(ofname, "wb");
+        if (ofp == NULL) {
+            fprintf(stderr, "出力ファイルを開けませんでした: %s\n", ofname);
+            goto out;
+        }
+    }
+
+    for (;;) {
+        long length = image_length(buf, len);
+        uint8_t vram[P6_VRAM_SIZE];
+        size_t vram_size, outsize;
+        const uint8_t *out;
+        image_t im;
+        int error;
+
+        if (length < 0) {
+            fprintf(stderr, "画像の形式を判別できません: %s のフレーム %lu\n",
+              ifname, frame);
+            goto out;
+        }
+        if (length == 0) {
+            /* 1枚分揃うまで読み足す */
+            if (eof) {
+                if (len == 0)
+                    break;
+                fprintf(stderr, "画像データが途中で終わっています: %s のフレーム %lu\n",
+                  ifname, frame);
+                goto out;
+            }
+            if (len == bufsize) {
+                bufsize = bufsize == 0 ? STREAM_CHUNK : bufsize * 2;
+                nbuf = realloc(buf, bufsize);
+                if (nbuf == NULL) {
+                    fprintf(stderr, "メモリが足りません\n");
+                    goto out;
+                }
+                buf = nbuf;
+            }
+            n = fread(buf + len, 1, bufsize - len, ifp);
+            if (n == 0) {
+                if (ferror(ifp)) {
+                    fprintf(stderr, "入力の読み込みに失敗しました: %s\n", ifname);
+                    goto out;
+                }
+                eof = 1;
+            }
+            len += n;
+            continue;
+        }
+
+        snprintf(name, sizeof(name), "%s のフレーム %lu", ifname, frame);
+        if (decode_image(buf, length, opt->mode, &im) != 0) {
+            fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+              name, stbi_failure_reason());
+            goto out;
+        }
+        error = convert_image(opt, name, &im, vram, &vram_size);
+        image_free(&im);
+        if (error != 0)
+            goto out;
+        if (encode_frame(&enc, name, vram, vram_size, &out, &outsize) != 0)
+            goto out;
+        if (frames != NULL) {
+            if (framelist_add(frames, out, outsize, 0) != 0) {
+                fprintf(stderr, "メモリが足りません\n");
+                goto out;
+            }
+        } else if (fwrite(out, 1, outsize, ofp) != outsize) {
+            fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+            goto out;
+        }
+
+        memmove(buf, buf + length, len - (size_t)length);
+        len -= (size_t)length;
+        frame++;
+    }
+    rv = 0;
+
+ out:
+    free(buf);
+    if (ifp != stdin)
+        fclose(ifp);
+    if (ofp != NULL && ofp != stdout) {
+        if (fclose(ofp) != 0 && rv == 0) {
+            fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+            rv = -1;
+        }
+    } else if (ofp == stdout && fflush(stdout) != 0 && rv == 0) {
+        fprintf(stderr, "標準出力への書き込みに失敗しました\n");
+        rv = -1;
+    }
+    return rv;
+}
+
+/*
+ * 固定サイズの生フレーム (rgb24 / gray8) が連続したストリームを変換し、
+ * VRAMデータを連結して書き出す（"-" は標準入力・標準出力）
+ * 入力は RAW_BLOCK_SIZE に入るだけのフレームをまとめて読み、読んだ順に変換する
+ * frames が NULL でなければ書き出さずに frames に貯める
+ */
+static int
+convert_raw(const convopt_t *opt, const rawfmt_t *fmt, const char *ifname,
+  const char *ofname, framelist_t *frames)
+{
+    FILE *ifp = stdin, *ofp = stdout;
+    uint8_t *buf = NULL, *rgb = NULL;
+    size_t frame_size, block_frames, n, i;
+    unsigned long frame = 0;
+    char name[PATH_MAX + 32];
+    encoder_t enc;
+    image_t im;
+    int rv = -1;
+
+    encoder_init(&enc, opt);
+
+    frame_size = (size_t)fmt->width * fmt->height * fmt->channels;
+    block_frames = RAW_BLOCK_SIZE / frame_size;
+    if (block_frames == 0)
+        block_frames = 1;
+    buf = malloc(block_frames * frame_size);
+    if (buf == NULL) {
+        fprintf(stderr, "メモリが足りません\n");
+        return -1;
+    }
+
+    im.width = fmt->width;
+    im.height = fmt->height;
+    im.channels = fmt->channels;
+    im.indexed = 0;
+    if (opt->mode == 3 && fmt->channels == 1) {
+        /* SCREEN 3 の変換は RGB で行うので、グレースケールは1フレームずつ広げる */
+        rgb = malloc(frame_size * 3);
+        if (rgb == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            goto out;
+        }
+        im.channels = 3;
+    }
+
+    if (strcmp(ifname, "-") != 0) {
+        ifp = fopen(ifname, "rb");
+        if (ifp == NULL) {
+            fprintf(stderr, "入力ファイルを開けませんでした: %s\n", ifname);
+            goto out;
+        }
+    }
+    if (frames != NULL) {
+        ofp = NULL;
+    } else if (strcmp(ofname, "-") != 0) {
+        ofp = fopen(ofname, "wb");
+        if (ofp == NULL) {
+            fprintf(stderr, "出力ファイルを開けませんでした: %s\n", ofname);
+            goto out;
+        }
+    }
+
+    do {
+        n = fread(buf, 1, block_frames * frame_size, ifp);
+        if (n < block_frames * frame_size && ferror(ifp)) {
+            fprintf(stderr, "入力の読み込みに失敗しました: %s\n", ifname);
+            goto out;
+        }
+
+        for (i = 0; i < n / frame_size; i++) {
+            uint8_t vram[P6_VRAM_SIZE];
+            size_t vram_size, outsize;
+            const uint8_t *out;
+
+            im.pixels = buf + i * frame_size;
+            if (rgb != NULL) {
+                size_t k;
+                for (k = 0; k < frame_size; k++)
+                    memset(&rgb[k * 3], im.pixels[k], 3);
+                im.pixels = rgb;
+            }
+            snprintf(name, sizeof(name), "%s のフレーム %lu", ifname, frame);
+            if (convert_image(opt, name, &im, vram, &vram_size) != 0)
+                goto out;
+            if (encode_frame(&enc, name, vram, vram_size, &out, &outsize) != 0)
+                goto out;
+            if (frames != NULL) {
+                if (framelist_add(frames, out, outsize, 0) != 0) {
+                    fprintf(stderr, "メモリが足りません\n");
+                    goto out;
+                }
+            } else if (fwrite(out, 1, outsize, ofp) != outsize) {
+                fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+                goto out;
+            }
+            frame++;
+        }
+        /* 揃っているフレームは変換してから、途中で終わったフレームを報告する */
+        if (n % frame_size != 0) {
+            fprintf(stderr, "フレームデータが途中で終わっています: %s のフレーム %lu\n",
+              ifname, frame);
+            goto out;
+        }
+    } while (n == block_frames * frame_size);
+    rv = 0;
+
+ out:
+    free(buf);
+    free(rgb);
+    if (ifp != NULL && ifp != stdin)
+        fclose(ifp);
+    if (ofp != NULL && ofp != stdout) {
+        if (fclose(ofp) != 0 && rv == 0) {
+            fprintf(stderr, "出力ファイルの書き込みに失敗しました: %s\n", ofname);
+            rv = -1;
+        }
+    } else if (ofp == stdout && fflush(stdout) != 0 && rv == 0) {
+        fprintf(stderr, "標準出力への書き込みに失敗しました\n");
+        rv = -1;
+    }
+    return rv;
+}
+
+/*
+ * -r の引数 "形式[:横x縦]" を解釈する
+ * 大きさを省略した場合は -x/-y の大きさ
+ */
+static int
+parse_rawfmt(const char *arg, rawfmt_t *fmt)
+{
+    const char *size = strchr(arg, ':');
+    size_t len = size != NULL ? (size_t)(size - arg) : strlen(arg);
+    char *endptr;
+
+    if (len == 5 && strncmp(arg, "rgb24", len) == 0)
+        fmt->channels = 3;
+    else if (len == 5 && strncmp(arg, "gray8", len) == 0)
+        fmt->channels = 1;
+    else
+        return -1;
+    if (size == NULL)
+        return 0;
+
+    fmt->width = (int)strtol(size + 1, &endptr, 10);
+    if (*endptr != 'x' || fmt->width < 1 || fmt->width > RAW_MAX_SIZE)
+        return -1;
+    fmt->height = (int)strtol(endptr + 1, &endptr, 10);
+    if (*endptr != '\0' || fmt->height < 1 || fmt->height > RAW_MAX_SIZE)
+        return -1;
+    /* 画像ファイルの入力と同じく、1フレームの大きさを MAX_INPUT_PIXELS までにする */
+    if ((uint64_t)fmt->width * fmt->height > MAX_INPUT_PIXELS)
+        return -1;
+    return 0;
+}
+
+/* ベンチマークの段階 */
+enum {
+    BENCH_READ,
+    BENCH_DECODE,
+    BENCH_CONVERT,
+    BENCH_WRITE,
+    BENCH_TOTAL,
+    BENCH_NSTAGES
+};
+
+static const char *const bench_stage_names[BENCH_NSTAGES] = {
+    "読み込み", "デコード", "変換", "書き出し", "合計"
+};
+
+static inline double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
 
-const char progname[] = "img2p6screen3";
+    return (x > y) - (x < y);
+}
 
-/* 固定の4色パレット（PC-6001 SCREEN 3） */
-typedef struct {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} palrgb_t;
+/* 表示幅（UTF-8 の非ASCII文字は全角として数える） */
+static int
+display_width(const char *str)
+{
+    const unsigned char *p;
+    int width = 0;
 
-typedef struct {
-    palrgb_t colors[4];
-} p6palette_t;
+    for (p = (const unsigned char *)str; *p != '\0'; p++) {
+        if (*p < 0x80)
+            width++;
+        else if ((*p & 0xc0) == 0xc0)
+            width += 2;
+    }
+    return width;
+}
 
-static const p6palette_t p6palette[2] = {
-    {
-        {
-            { .r =   0, .g = 255, .b =   0 }, // 緑
-            { .r = 255, .g = 255, .b =   0 }, // 黄
-            { .r =   0, .g =   0, .b = 255 }, // 青
-            { .r = 255, .g =   0, .b =   0 }, // 赤
+/* 表示幅 width に揃えて表示する（right が真なら右寄せ） */
+static void
+print_padded(const char *str, int width, int right)
+{
+    int pad = width - display_width(str);
+
+    if (right)
+        printf("%*s%s", pad > 0 ? pad : 0, "", str);
+    else
+        printf("%s%*s", str, pad > 0 ? pad : 0, "");
+}
+
+/* 1段階分の最小・中央値・99パーセンタイルを表示（単位はマイクロ秒） */
+static void
+bench_report(const char *stage, double *samples, int count)
+{
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    printf("  ");
+    print_padded(stage, 10, 0);
+    printf(" %10.1f %10.1f %10.1f\n", samples[0],
+      samples[count / 2], samples[(int)((count - 1) * 0.99)]);
+}
+
+/* ファイルのページキャッシュを捨てさせる（できなければ -1） */
+static int
+bench_evict(const char *ifname)
+{
+    int fd, error;
+
+    fd = open(ifname, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    error = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return error == 0 ? 0 : -1;
+}
+
+/*
+ * 入力ファイルの読み込み方式 (read と mmap) を比べる
+ * mmap はページの読み込みがデコード中に起きるので、解放までを含めた合計で比べる
+ * キャッシュなしは毎回ページキャッシュから追い出してから読む
+ * samples は count 個の配列を BENCH_NSTAGES 個
+ */
+static int
+bench_input(const convopt_t *opt, const char *ifname, int count,
+  double *samples[])
+{
+    static const struct {
+        const char *name;
+        int mmap;
+        int cold;
+    } methods[] = {
+        { "read", 0, 0 },
+        { "mmap", 1, 0 },
+        { "read キャッシュなし", 0, 1 },
+        { "mmap キャッシュなし", 1, 1 },
+    };
+    size_t k;
+    int i, stage;
+
+    printf("入力の読み込み方式:\n  ");
+    print_padded("方式", 22, 0);
+    print_padded("読み込み", 11, 1);
+    print_padded("デコード", 11, 1);
+    print_padded("合計", 11, 1);
+    print_padded("合計99%", 11, 1);
+    printf(" (中央値、マイクロ秒)\n");
+    for (k = 0; k < sizeof(methods) / sizeof(methods[0]); k++) {
+        for (i = 0; i < count; i++) {
+            double t[3];
+            input_t in;
+            image_t im;
+
+            if (methods[k].cold && bench_evict(ifname) != 0)
+                break;
+            t[0] = bench_now();
+            if (read_input(ifname, methods[k].mmap, &in) != 0)
+                return -1;
+            t[1] = bench_now();
+            if (decode_image(in.data, in.size, opt->mode, &im) != 0) {
+                fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+                  ifname, stbi_failure_reason());
+                input_release(&in);
+                return -1;
+            }
+            input_release(&in);
+            t[2] = bench_now();
+            image_free(&im);
+            samples[BENCH_READ][i] = t[1] - t[0];
+            samples[BENCH_DECODE][i] = t[2] - t[1];
+            samples[BENCH_TOTAL][i] = t[2] - t[0];
         }
-    },
-    {
-        {
-            { .r = 255, .g = 255, .b = 255 }, // 白
-            { .r =   0, .g = 255, .b = 255 }, // シアン
-            { .r = 255, .g =   0, .b = 255 }, // マゼンタ
-            { .r = 255, .g = 128, .b =   0 }, // 橙
+        printf("  ");
+        print_padded(methods[k].name, 22, 0);
+        if (i < count) {
+            printf(" （ページキャッシュを捨てられないので測れません）\n");
+            continue;
+        }
+        for (stage = 0; stage < BENCH_NSTAGES; stage++) {
+            if (stage == BENCH_READ || stage == BENCH_DECODE ||
+              stage == BENCH_TOTAL)
+                qsort(samples[stage], count, sizeof(double), compare_double);
         }
+        printf(" %10.1f %10.1f %10.1f %10.1f\n", samples[BENCH_READ][count / 2],
+          samples[BENCH_DECODE][count / 2], samples[BENCH_TOTAL][count / 2],
+          samples[BENCH_TOTAL][(int)((count - 1) * 0.99)]);
     }
-};
+    return 0;
+}
 
+/* 画像を指定しない場合に使う合成画像（グラデーションと疑似乱数） */
 static void
-usage(void)
+bench_synthetic_image(uint8_t *img, int width, int height)
 {
-    fprintf(stderr, "使い方: %s [-m 3|4] [-c 1|2] [-x xsize] [-y ysize] 入力画像ファイル 出力バイナリファイル\n", progname);
-    fprintf(stderr, "  -m 3     screen3 画像VRAM ※デフォルト\n");
-    fprintf(stderr, "  -m 4     screen4 画像VRAM\n");
-    fprintf(stderr, "  -c 1     color,,1 パレット（緑・黄・青・赤）※デフォルト\n");
-    fprintf(stderr, "  -c 2     color,,2 パレット（白・シアン・マゼンタ・橙）\n");
-    fprintf(stderr, "  -x xsize 画像の横サイズ xsize ドットのデータを作成\n");
-    fprintf(stderr, "  -y ysize 画像の縦サイズ ysize ドットのデータを作成\n");
-    exit(EXIT_FAILURE);
+    uint32_t state = 0x2545f491;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint8_t *p = &img[(y * width + x) * 3];
+            uint32_t v;
+            /* xorshift32 */
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            v = state;
+            p[0] = (uint8_t)(x + (v & 0x1f));
+            p[1] = (uint8_t)(y + ((v >> 8) & 0x1f));
+            p[2] = (uint8_t)(x + y + ((v >> 16) & 0x1f));
+        }
+    }
+}
+
+/*
+ * 画像のヘッダから大きさを調べて変換できるか判定する
+ * head は入力ファイルの先頭 len バイトで、whole が偽ならファイルはまだ続く
+ * （ヘッダが先頭に収まっていなければ全体を読み込んで調べ直す）
+ * 変換できなければ job->failed を立てて 1 を返す
+ */
+static int
+preflight_check(const convopt_t *opt, const p6_config_t *cf, job_t *job,
+  const uint8_t *head, size_t len, int whole)
+{
+    int width, height, comp, ok;
+    input_t in;
+
+    ok = stbi_info_from_memory(head, (int)len, &width, &height, &comp);
+    if (!ok && !whole) {
+        /* JPEG の Exif 等でヘッダが長い */
+        if (read_input(job->ifname, opt->mmap_input, &in) != 0) {
+            job->failed = 1;
+            return 1;
+        }
+        ok = stbi_info_from_memory(in.data, (int)in.size, &width, &height,
+          &comp);
+        input_release(&in);
+    }
+    if (!ok) {
+        fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+          job->ifname, stbi_failure_reason());
+    } else if ((uint64_t)width * height > MAX_INPUT_PIXELS) {
+        fprintf(stderr, "エラー: 入力画像が大きすぎます（%s の画像サイズ: %dx%d）\n",
+          job->ifname, width, height);
+    } else if (!opt->fit && p6_check_size(cf, width, height) < 0) {
+        fprintf(stderr, "エラー: 入力画像のサイズは %dx%d である必要があります（%s の画像サイズ: %dx%d）\n",
+          opt->img_xsize, opt->img_ysize, job->ifname, width, height);
+    } else {
+        return 0;
+    }
+    job->failed = 1;
+    return 1;
+}
+
+/*
+ * 入力ファイルの先頭 PREFLIGHT_HEAD バイトまでを buf に読む
+ * 標準入力やパイプ等の通常のファイルでないものは読み直せないので読まずに 1 を返す
+ */
+static int
+read_head(const char *ifname, uint8_t *buf, size_t *lenp)
+{
+    struct stat st;
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if (strcmp(ifname, "-") == 0)
+        return 1;
+    count_syscalls(1);
+    if (stat(ifname, &st) == 0 && !S_ISREG(st.st_mode))
+        return 1;
+    fd = open(ifname, O_RDONLY);
+    count_syscalls(1);
+    if (fd == -1) {
+        fprintf(stderr, "入力ファイルを開けませんでした: %s\n", ifname);
+        return -1;
+    }
+    while (len < PREFLIGHT_HEAD) {
+        n = read(fd, buf + len, PREFLIGHT_HEAD - len);
+        count_syscalls(1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    count_syscalls(1);
+    close(fd);
+    *lenp = len;
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/* preflight() の io_uring 版（ヘッダの読み込みを URING_BATCH ファイルずつまとめる） */
+static size_t
+uring_preflight(uring_t *u, const convopt_t *opt, joblist_t *jl)
+{
+    job_t *jobs[URING_BATCH];
+    input_t in[URING_BATCH];
+    p6_config_t cf;
+    size_t j = 0, nbad = 0;
+    int i, n;
+
+    make_config(opt, &cf);
+    while (j < jl->njobs) {
+        for (n = 0; n < URING_BATCH && j < jl->njobs; n++, j++)
+            jobs[n] = &jl->jobs[j];
+        uring_read_inputs(u, jobs, n, in, PREFLIGHT_HEAD);
+        for (i = 0; i < n; i++) {
+            if (jobs[i]->failed) {
+                nbad++;
+            } else if (in[i].data != NULL) {
+                nbad += preflight_check(opt, &cf, jobs[i], in[i].data,
+                  in[i].size, in[i].size < PREFLIGHT_HEAD);
+                input_release(&in[i]);
+            }
+        }
+    }
+    return nbad;
+}
+#endif
+
+/*
+ * 変換を始める前に全ファイルのヘッダだけを読んで大きさを調べ、
+ * 変換できないファイルを全部まとめて報告する（そのファイルは job->failed を立てる）
+ * 標準入力やパイプ等の通常のファイルでないものは読み直せないので調べない
+ * 変換できないファイルの数を返す
+ */
+static size_t
+preflight(const convopt_t *opt, joblist_t *jl)
+{
+    p6_config_t cf;
+    size_t j, nbad = 0;
+#ifdef HAVE_IO_URING
+    uring_t ring;
+
+    if (opt->io_uring && uring_init(&ring) == 0) {
+        nbad = uring_preflight(&ring, opt, jl);
+        uring_free(&ring);
+        return nbad;
+    }
+#endif
+
+    make_config(opt, &cf);
+    for (j = 0; j < jl->njobs; j++) {
+        job_t *job = &jl->jobs[j];
+        uint8_t head[PREFLIGHT_HEAD];
+        size_t len;
+        int error;
+
+        error = read_head(job->ifname, head, &len);
+        if (error > 0)
+            continue;
+        if (error < 0) {
+            job->failed = 1;
+            nbad++;
+            continue;
+        }
+        nbad += preflight_check(opt, &cf, job, head, len,
+          len < PREFLIGHT_HEAD);
+    }
+    return nbad;
+}
+
+/*
+ * 一括変換のファイル入出力を count ファイル分計測する
+ * 入力は ifname を繰り返し、URING_BATCH ファイルずつ preflight() のヘッダの検査をしてから読み、
+ * 出力は base に番号を付けた URING_BATCH 個のファイルに VRAMデータの大きさで書く
+ * （デコード・変換はしない）
+ * 1ファイルあたりの時間と、入出力で呼んだシステムコールの数を表示する
+ */
+static int
+bench_batch_io(const convopt_t *opt, const char *ifname, int count,
+  const char *base)
+{
+    static uint8_t vram[P6_VRAM_SIZE];
+    char names[URING_BATCH][PATH_MAX + 8];
+    job_t jobs[URING_BATCH];
+    joblist_t jl = { .jobs = jobs, .njobs = 0, .maxjobs = URING_BATCH };
+    outputitem_t *items[URING_BATCH];
+    convopt_t popt = *opt;
+    double t0, t1;
+    unsigned long n0;
+    int done, i, n, rv = -1;
+#ifdef HAVE_IO_URING
+    job_t *batch[URING_BATCH];
+    input_t in[URING_BATCH];
+    uring_t ring;
+    int use_uring = uring_init(&ring) == 0;
+#endif
+
+    for (i = 0; i < URING_BATCH; i++)
+        snprintf(names[i], sizeof(names[i]), "%s.%d", base, i);
+    memset(items, 0, sizeof(items));
+    for (i = 0; i < URING_BATCH; i++) {
+        items[i] = malloc(sizeof(*items[i]) + sizeof(vram));
+        if (items[i] == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            goto out;
+        }
+        jobs[i].ifname = (char *)ifname;
+        jobs[i].ofname = names[i];
+        jobs[i].failed = 0;
+        items[i]->job = &jobs[i];
+        items[i]->ofname = names[i];
+        items[i]->size = sizeof(vram);
+        memcpy(items[i]->data, vram, sizeof(vram));
+    }
+
+    printf("一括変換の入出力 (%d ファイルずつ):\n  ", URING_BATCH);
+    print_padded("方式", 10, 0);
+    print_padded("時間", 11, 1);
+    print_padded("呼び出し", 11, 1);
+    printf(" (1ファイルあたりのマイクロ秒とシステムコール数)\n");
+
+    popt.io_uring = 0;
+    n0 = atomic_load(&nsyscalls);
+    t0 = bench_now();
+    for (done = 0; done < count; done += n) {
+        n = count - done < URING_BATCH ? count - done : URING_BATCH;
+        jl.njobs = n;
+        if (preflight(&popt, &jl) != 0)
+            goto out;
+        for (i = 0; i < n; i++) {
+            input_t one;
+            if (read_input(ifname, opt->mmap_input, &one) != 0)
+                goto out;
+            prefetch_input(&one);
+            input_release(&one);
+            if (write_vram(names[i], vram, sizeof(vram)) != 0)
+                goto out;
+        }
+    }
+    t1 = bench_now();
+    printf("  ");
+    print_padded(opt->mmap_input ? "mmap" : "read", 10, 0);
+    printf(" %10.1f %10.1f\n", (t1 - t0) / count,
+      (double)(atomic_load(&nsyscalls) - n0) / count);
+
+    printf("  ");
+    print_padded("io_uring", 10, 0);
+#ifdef HAVE_IO_URING
+    if (!use_uring) {
+        printf(" （io_uring が使えません）\n");
+        rv = 0;
+        goto out;
+    }
+    for (i = 0; i < URING_BATCH; i++)
+        batch[i] = &jobs[i];
+    n0 = atomic_load(&nsyscalls);
+    t0 = bench_now();
+    for (done = 0; done < count; done += n) {
+        n = count - done < URING_BATCH ? count - done : URING_BATCH;
+        jl.njobs = n;
+        if (uring_preflight(&ring, opt, &jl) != 0)
+            goto out;
+        uring_read_inputs(&ring, batch, n, in, 0);
+        for (i = 0; i < n; i++)
+            input_release(&in[i]);
+        uring_write_outputs(&ring, items, n);
+        for (i = 0; i < n; i++) {
+            if (jobs[i].failed)
+                goto out;
+        }
+    }
+    t1 = bench_now();
+    printf(" %10.1f %10.1f\n", (t1 - t0) / count,
+      (double)(atomic_load(&nsyscalls) - n0) / count);
+#else
+    printf(" （USE_IO_URING を定義せずにビルドされています）\n");
+#endif
+    rv = 0;
+
+ out:
+#ifdef HAVE_IO_URING
+    if (use_uring)
+        uring_free(&ring);
+#endif
+    for (i = 0; i < URING_BATCH; i++) {
+        unlink(names[i]);
+        free(items[i]);
+    }
+    return rv;
+}
+
+/*
+ * 同じ画像を count 回変換して各段階の処理時間を測る
+ * SCREEN 3 と SCREEN 4 の両方を測り、ifname が NULL なら合成画像を使う
+ */
+static int
+bench(const convopt_t *opt, const char *ifname, int count)
+{
+    static const int modes[] = { 3, 4 };
+    double *samples[BENCH_NSTAGES];
+    char ofname[PATH_MAX];
+    const char *tmpdir;
+    uint8_t *synthetic = NULL;
+    convopt_t mopt = *opt;
+    int fd, i, m, stage, rv = -1;
+
+    for (stage = 0; stage < BENCH_NSTAGES; stage++) {
+        samples[stage] = calloc(count, sizeof(double));
+        if (samples[stage] == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (ifname == NULL) {
+        synthetic = malloc((size_t)opt->img_xsize * opt->img_ysize * 3);
+        if (synthetic == NULL) {
+            fprintf(stderr, "メモリが足りません\n");
+            exit(EXIT_FAILURE);
+        }
+        bench_synthetic_image(synthetic, opt->img_xsize, opt->img_ysize);
+    }
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || tmpdir[0] == '\0')
+        tmpdir = "/tmp";
+    snprintf(ofname, sizeof(ofname), "%s/img2p6bench.XXXXXX", tmpdir);
+    fd = mkstemp(ofname);
+    if (fd == -1) {
+        fprintf(stderr, "一時ファイルを作れませんでした: %s\n", ofname);
+        ofname[0] = '\0';
+        goto out;
+    }
+    close(fd);
+
+    printf("ベンチマーク: %s (%dx%d) カーネル %s, %d回%s\n",
+      ifname != NULL ? ifname : "合成画像", opt->img_xsize, opt->img_ysize,
+      p6_kernel_name(), count, ifname == NULL ? "" :
+      opt->mmap_input ? ", 入力 mmap" : ", 入力 read");
+
+    for (m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+        double total = 0;
+        mopt.mode = modes[m];
+        for (i = 0; i < count; i++) {
+            uint8_t vram[P6_VRAM_SIZE];
+            size_t vram_size;
+            input_t in;
+            image_t im = {
+                .pixels = synthetic, .width = opt->img_xsize,
+                .height = opt->img_ysize, .channels = 3, .indexed = 0,
+            };
+            double t[BENCH_NSTAGES];
+
+            t[BENCH_READ] = bench_now();
+            if (ifname != NULL &&
+              read_input(ifname, opt->mmap_input, &in) != 0)
+                goto out;
+            t[BENCH_DECODE] = bench_now();
+            if (ifname != NULL) {
+                int error = decode_image(in.data, in.size, mopt.mode, &im);
+                input_release(&in);
+                if (error != 0) {
+                    fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
+                      ifname, stbi_failure_reason());
+                    goto out;
+                }
+            }
+            t[BENCH_CONVERT] = bench_now();
+            if (convert_image(&mopt, ifname != NULL ? ifname : "合成画像",
+              &im, vram, &vram_size) != 0) {
+                if (im.pixels != synthetic)
+                    image_free(&im);
+                goto out;
+            }
+            t[BENCH_WRITE] = bench_now();
+            if (write_vram(ofname, vram, vram_size) != 0) {
+                if (im.pixels != synthetic)
+                    image_free(&im);
+                goto out;
+            }
+            t[BENCH_TOTAL] = bench_now();
+            if (im.pixels != synthetic)
+                image_free(&im);
+
+            for (stage = 0; stage < BENCH_TOTAL; stage++)
+                samples[stage][i] = t[stage + 1] - t[stage];
+            samples[BENCH_TOTAL][i] = t[BENCH_TOTAL] - t[BENCH_READ];
+            total += samples[BENCH_TOTAL][i];
+        }
+
+        printf("SCREEN %d:\n  ", mopt.mode);
+        print_padded("段階", 10, 0);
+        print_padded("最小", 11, 1);
+        print_padded("中央値", 11, 1);
+        print_padded("99%", 11, 1);
+        printf(" (マイクロ秒)\n");
+        for (stage = 0; stage < BENCH_NSTAGES; stage++) {
+            if (ifname == NULL &&
+              (stage == BENCH_READ || stage == BENCH_DECODE))
+                continue;
+            bench_report(bench_stage_names[stage], samples[stage], count);
+        }
+        printf("  %.1f フレーム/秒\n", total > 0 ? count * 1e6 / total : 0.0);
+    }
+    if (ifname != NULL && bench_input(opt, ifname, count, samples) != 0)
+        goto out;
+    if (ifname != NULL && bench_batch_io(opt, ifname, count, ofname) != 0)
+        goto out;
+    rv = 0;
+
+ out:
+    if (ofname[0] != '\0')
+        unlink(ofname);
+    free(synthetic);
+    for (stage = 0; stage < BENCH_NSTAGES; stage++)
+        free(samples[stage]);
+    return rv;
+}
+
+/* 読み込んだ入力を1つ変換する */
+static void
+pipeline_convert(pipeline_t *pl, inputitem_t *item)
+{
+
+    if ((pl->opt->animation ? convert_animation : convert_file)(pl,
+      item->job, &item->in) != 0)
+        item->job->failed = 1;
+    input_release(&item->in);
+    free(item);
+}
+
+/* ワーカースレッド: 読み込み済みの入力を取り出して変換する */
+static void *
+pipeline_worker(void *arg)
+{
+    pipeline_t *pl = arg;
+    inputitem_t *item;
+
+    while ((item = queue_get(&pl->inputs)) != NULL)
+        pipeline_convert(pl, item);
+    return NULL;
+}
+
+/* 書き出しスレッド: 変換済みのフレームを取り出して書き出す */
+static void *
+pipeline_writer(void *arg)
+{
+    pipeline_t *pl = arg;
+    outputitem_t *item;
+
+#ifdef HAVE_IO_URING
+    uring_t ring;
+
+    if (pl->opt->io_uring && uring_init(&ring) == 0) {
+        /* 溜まっている分をまとめて書き出す */
+        outputitem_t *items[URING_BATCH];
+        int i, n;
+
+        while ((items[0] = queue_get(&pl->outputs)) != NULL) {
+            for (n = 1; n < URING_BATCH; n++) {
+                if ((items[n] = queue_tryget(&pl->outputs)) == NULL)
+                    break;
+            }
+            uring_write_outputs(&ring, items, n);
+            for (i = 0; i < n; i++)
+                free(items[i]);
+        }
+        uring_free(&ring);
+        return NULL;
+    }
+#endif
+    while ((item = queue_get(&pl->outputs)) != NULL) {
+        if (write_vram(item->ofname, item->data, item->size) != 0)
+            item->job->failed = 1;
+        free(item);
+    }
+    return NULL;
+}
+
+/* 読み込んだ入力をワーカースレッドに渡す（ワーカースレッドがなければここで変換する） */
+static void
+pipeline_feed(pipeline_t *pl, job_t *job, input_t *in, int nworkers)
+{
+    inputitem_t *item;
+
+    item = malloc(sizeof(*item));
+    if (item == NULL) {
+        fprintf(stderr, "メモリが足りません\n");
+        input_release(in);
+        job->failed = 1;
+        return;
+    }
+    item->job = job;
+    item->in = *in;
+    if (nworkers == 0) {
+        pipeline_convert(pl, item);
+        return;
+    }
+    queue_put(&pl->inputs, item);
 }
 
-/* 最近傍色インデックスを求める */
-static unsigned int
-nearest_color(const p6palette_t *palette, uint8_t r, uint8_t g, uint8_t b)
+#ifdef HAVE_IO_URING
+/* 失敗していない入力を URING_BATCH 個ずつまとめて読み込んで渡す */
+static void
+pipeline_read_uring(pipeline_t *pl, uring_t *u, int nworkers)
 {
-    unsigned int min_dist = UINT_MAX;
-    unsigned int index = 0;
-    unsigned int i;
-    for (i = 0; i < 4; ++i) {
-        int dr = (int)r - (int)palette->colors[i].r;
-        int dg = (int)g - (int)palette->colors[i].g;
-        int db = (int)b - (int)palette->colors[i].b;
-        unsigned int dist = (dr * dr) + (dg * dg) + (db * db);
-        if (dist < min_dist) {
-            min_dist = dist;
-            index = i;
+    job_t *jobs[URING_BATCH];
+    input_t in[URING_BATCH];
+    size_t j = 0;
+    int i, n;
+
+    while (j < pl->jl->njobs) {
+        for (n = 0; n < URING_BATCH && j < pl->jl->njobs; j++) {
+            if (!pl->jl->jobs[j].failed)
+                jobs[n++] = &pl->jl->jobs[j];
+        }
+        if (n == 0)
+            break;
+        uring_read_inputs(u, jobs, n, in, 0);
+        for (i = 0; i < n; i++) {
+            if (!jobs[i]->failed)
+                pipeline_feed(pl, jobs[i], &in[i], nworkers);
         }
     }
-    return index;
 }
+#endif
 
-static inline int
-rgb_to_gray(int r, int g, int b)
+/*
+ * 全ファイルを変換する
+ * 呼び出し元のスレッドが入力ファイルを順に先読みし、nthreads 個のワーカースレッドが
+ * デコード・変換・符号化、書き出しスレッドが出力ファイルの書き出しを受け持つ
+ * io_uring が使えれば読み込みと書き出しは URING_BATCH ファイルずつまとめて行う
+ * 各ファイルの変換は独立しているので、出力内容はスレッド数によらず同じ
+ */
+static void
+convert_all(const convopt_t *opt, joblist_t *jl, int nthreads)
 {
+    pthread_t threads[MAX_THREADS], writer;
+    pipeline_t pl = { .opt = opt, .jl = jl };
+    int t, nstarted;
+    size_t j;
+#ifdef HAVE_IO_URING
+    uring_t ring;
+#endif
+
+    if ((size_t)nthreads > jl->njobs)
+        nthreads = (int)jl->njobs;
+    queue_init(&pl.inputs);
+    queue_init(&pl.outputs);
+    pl.async_write = pthread_create(&writer, NULL, pipeline_writer, &pl) == 0;
+    for (nstarted = 0; nstarted < nthreads; nstarted++) {
+        if (pthread_create(&threads[nstarted], NULL, pipeline_worker,
+          &pl) != 0)
+            break;
+    }
 
-    return (299 * r + 587 * g + 114 * b) / 1000;
+#ifdef HAVE_IO_URING
+    if (opt->io_uring && uring_init(&ring) == 0) {
+        pipeline_read_uring(&pl, &ring, nstarted);
+        uring_free(&ring);
+    } else
+#endif
+    for (j = 0; j < jl->njobs; j++) {
+        job_t *job = &jl->jobs[j];
+        input_t in;
+
+        if (job->failed)
+            continue;
+        if (read_input(job->ifname, opt->mmap_input, &in) != 0) {
+            job->failed = 1;
+            continue;
+        }
+        if (nstarted > 0)
+            prefetch_input(&in);
+        pipeline_feed(&pl, job, &in, nstarted);
+    }
+
+    queue_close(&pl.inputs);
+    for (t = 0; t < nstarted; t++)
+        pthread_join(threads[t], NULL);
+    if (pl.async_write) {
+        queue_close(&pl.outputs);
+        pthread_join(writer, NULL);
+    }
+    queue_destroy(&pl.inputs);
+    queue_destroy(&pl.outputs);
 }
 
 int
 main(int argc, char *argv[])
 {
-    int mode = 3;
-    int color_type = 1;
-    int img_xsize = IMG_XSIZE;
-    int img_ysize = IMG_YSIZE;
-    int img_stride;
-    int width, height, channels;
-    int c, i, y, x_byte;
-    uint8_t *img = NULL;
-    const char *ifname, *ofname;
-    const p6palette_t *palette;
-    FILE *ofp = NULL;
-    int status = EXIT_FAILURE;
-
-    while ((c = getopt(argc, argv, "c:m:x:y:")) != -1) {
+    convopt_t opt = {
+        .mode = 3,
+        .color_type = 1,
+        .img_xsize = P6_XSIZE,
+        .img_ysize = P6_YSIZE,
+        .encoding = ENC_RAW,
+        .verify = 0,
+        .lz_byte_cost = P6_LZ_BYTE_COST,
+        .dither = P6_DITHER_NONE,
+        .frame_threads = 1,
+        .fit = 0,
+        .animation = 0,
+        .mmap_input = 1,
+        .io_uring = 1,
+    };
+    joblist_t jl = { .jobs = NULL, .njobs = 0, .maxjobs = 0 };
+    const char *listname = NULL;
+    const char *container = NULL;
+    framelist_t frames;
+    int batch = 0;
+    int stream = 0;
+    int raw = 0;
+    rawfmt_t rawfmt = { .channels = 3, .width = 0, .height = 0 };
+    int nthreads = 1;
+    static p6_fs_pool_t fs_pool;
+    int do_selftest = 0;
+    int bench_count = 0;
+    const char *kernel_name = NULL;
+    size_t j, nfailed;
+    int c, i;
+
+    static const struct option longopts[] = {
+        { "selftest", no_argument, NULL, OPT_SELFTEST },
+        { "kernel", required_argument, NULL, OPT_KERNEL },
+        { "bench", optional_argument, NULL, OPT_BENCH },
+        { "verify", no_argument, NULL, OPT_VERIFY },
+        { "lz-byte-cost", required_argument, NULL, OPT_LZ_BYTE_COST },
+        { "frame-threads", required_argument, NULL, OPT_FRAME_THREADS },
+        { "fit", no_argument, NULL, OPT_FIT },
+        { "no-mmap", no_argument, NULL, OPT_NO_MMAP },
+        { "no-io-uring", no_argument, NULL, OPT_NO_IO_URING },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((c = getopt_long(argc, argv, "abC:c:d:j:l:m:r:Sx:y:z:", longopts, NULL)) != -1) {
         char *endptr;
         switch (c) {
+        case 'a':
+            opt.animation = 1;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'C':
+            container = optarg;
+            break;
         case 'c':
-            color_type = (int)strtol(optarg, &endptr, 10);
-            if (*endptr != '\0' || color_type < 1 || color_type > 2) {
+            opt.color_type = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt.color_type < 1 || opt.color_type > 2) {
+                usage();
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "none") == 0)
+                opt.dither = P6_DITHER_NONE;
+            else if (strcmp(optarg, "fs") == 0)
+                opt.dither = P6_DITHER_FS;
+            else if (strcmp(optarg, "bayer4") == 0)
+                opt.dither = P6_DITHER_BAYER4;
+            else if (strcmp(optarg, "bayer8") == 0)
+                opt.dither = P6_DITHER_BAYER8;
+            else
+                usage();
+            break;
+        case 'j':
+            nthreads = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || nthreads < 0 || nthreads > MAX_THREADS) {
                 usage();
             }
+            if (nthreads == 0) {
+                long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                nthreads = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : (int)ncpu;
+            }
+            break;
+        case 'l':
+            listname = optarg;
             break;
         case 'm':
-            mode = (int)strtol(optarg, &endptr, 10);
-            if (*endptr != '\0' || (mode != 3 && mode != 4)) {
+            opt.mode = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || (opt.mode != 3 && opt.mode != 4)) {
                 usage();
             }
             break;
+        case 'r':
+            if (parse_rawfmt(optarg, &rawfmt) != 0)
+                usage();
+            raw = 1;
+            break;
+        case 'S':
+            stream = 1;
+            break;
         case 'x':
-            img_xsize = (int)strtol(optarg, &endptr, 10);
-            if (*endptr != '\0' || img_xsize < 1 || img_xsize > IMG_XSIZE) {
+            opt.img_xsize = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt.img_xsize < 1 || opt.img_xsize > P6_XSIZE) {
                 usage();
             }
             break;
         case 'y':
-            img_ysize = (int)strtol(optarg, &endptr, 10);
-            if (*endptr != '\0' || img_ysize < 1 || img_ysize > IMG_YSIZE) {
+            opt.img_ysize = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt.img_ysize < 1 || opt.img_ysize > P6_YSIZE) {
+                usage();
+            }
+            break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0)
+                opt.encoding = ENC_RAW;
+            else if (strcmp(optarg, "delta") == 0)
+                opt.encoding = ENC_DELTA;
+            else if (strcmp(optarg, "rle") == 0)
+                opt.encoding = ENC_RLE;
+            else if (strcmp(optarg, "lz") == 0)
+                opt.encoding = ENC_LZ;
+            else
+                usage();
+            break;
+        case OPT_SELFTEST:
+            do_selftest = 1;
+            break;
+        case OPT_KERNEL:
+            kernel_name = optarg;
+            break;
+        case OPT_VERIFY:
+            opt.verify = 1;
+            break;
+        case OPT_FIT:
+            opt.fit = 1;
+            break;
+        case OPT_NO_MMAP:
+            opt.mmap_input = 0;
+            break;
+        case OPT_NO_IO_URING:
+            opt.io_uring = 0;
+            break;
+        case OPT_FRAME_THREADS:
+            opt.frame_threads = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt.frame_threads < 1 ||
+              opt.frame_threads > P6_MAX_FRAME_THREADS) {
+                usage();
+            }
+            break;
+        case OPT_LZ_BYTE_COST:
+            opt.lz_byte_cost = (int)strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || opt.lz_byte_cost < 0 ||
+              opt.lz_byte_cost > 65536) {
                 usage();
             }
             break;
+        case OPT_BENCH:
+            bench_count = BENCH_COUNT;
+            if (optarg != NULL) {
+                bench_count = (int)strtol(optarg, &endptr, 10);
+                if (*endptr != '\0' || bench_count < 1) {
+                    usage();
+                }
+            }
+            break;
         default:
             usage();
         }
@@ -158,86 +3262,214 @@ main(int argc, char *argv[])
     argc -= optind;
     argv += optind;
 
-    if (argc != 2)
-        usage();
+    if (p6_init(kernel_name) != 0) {
+        fprintf(stderr, "変換カーネル %s は使えません\n", kernel_name);
+        exit(EXIT_FAILURE);
+    }
+    if (opt.frame_threads > 1 && !do_selftest) {
+        /*
+         * 誤差拡散の2番目以降のスレッドは全ワーカースレッドで共有するプールから借りる
+         * ラインの受け渡しのたびにスレッドが切り替わるので、空いている CPU の数までしか作らない
+         * （作れなかった場合や足りない場合は、その分を各ワーカースレッドが処理する）
+         */
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int npool = (opt.frame_threads - 1) * nthreads;
+        if (ncpu >= 1 && npool > ncpu - 1)
+            npool = (int)ncpu - 1;
+        if (npool > P6_FS_POOL_MAX_THREADS)
+            npool = P6_FS_POOL_MAX_THREADS;
+        if (npool > 0 && p6_fs_pool_init(&fs_pool, npool) == 0)
+            opt.fs_pool = &fs_pool;
+    }
 
-    ifname = argv[0];
-    ofname = argv[1];
-    palette = &p6palette[color_type - 1];
+    if (do_selftest) {
+        if (argc != 0)
+            usage();
+        exit(p6_selftest() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    img = stbi_load(ifname, &width, &height, &channels, 3); /* RGB固定 */
-    if (img == NULL) {
-        fprintf(stderr, "画像を読み込めませんでした: %s (%s)\n",
-          ifname, stbi_failure_reason());
-        goto out;
+    if (bench_count > 0) {
+        if (argc > 1)
+            usage();
+        exit(bench(&opt, argc == 1 ? argv[0] : NULL, bench_count) == 0 ?
+          EXIT_SUCCESS : EXIT_FAILURE);
     }
 
-    if (width != img_xsize || height != img_ysize) {
-        fprintf(stderr, "エラー: 入力画像のサイズは %dx%d である必要があります（入力画像サイズ: %dx%d）\n",
-          img_xsize, img_ysize, width, height);
-        goto out;
+    memset(&frames, 0, sizeof(frames));
+
+    /* 差分符号化は前後のフレームがつながる出力でしか意味がない */
+    if (opt.encoding == ENC_DELTA && !stream && !raw && container == NULL) {
+        fprintf(stderr, "-z delta は -C か -S か -r と一緒に指定してください\n");
+        exit(EXIT_FAILURE);
     }
 
-    ofp = fopen(ofname, "wb");
-    if (ofp == NULL) {
-        fprintf(stderr, "出力ファイルを開けませんでした: %s\n", ofname);
-        goto out;
+    if (raw) {
+        int error;
+        if (stream || batch || listname != NULL || opt.animation)
+            usage();
+        if (rawfmt.width == 0) {
+            rawfmt.width = opt.img_xsize;
+            rawfmt.height = opt.img_ysize;
+        }
+        if (container != NULL) {
+            if (argc != 1)
+                usage();
+            error = convert_raw(&opt, &rawfmt, argv[0], NULL, &frames);
+            if (error == 0)
+                error = write_container(container, &opt, &frames);
+            framelist_free(&frames);
+        } else {
+            if (argc != 2)
+                usage();
+            error = convert_raw(&opt, &rawfmt, argv[0], argv[1], NULL);
+        }
+        exit(error == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
     }
 
-    if (mode == 3) {
-        /* 元画像横2ドットをP6画像1ドットにして 1バイトあたり4ドット */
-        img_stride = (((img_xsize / 2) + 3) / 4);
-        for (y = 0; y < img_ysize; y++) {
-            for (x_byte = 0; x_byte < img_stride; x_byte++) {
-                uint8_t out_byte = 0;
-                for (i = 0; i < 4; ++i) {
-                    /* 2ドットを1ドットに平均化 */
-                    int x = (x_byte * 4 + i) * 2;
-                    int idx1 = (y * img_xsize + x) * 3;
-                    int idx2 = (y * img_xsize + x + 1) * 3;
-                    uint8_t r = (img[idx1 + 0] + img[idx2 + 0]) / 2;
-                    uint8_t g = (img[idx1 + 1] + img[idx2 + 1]) / 2;
-                    uint8_t b = (img[idx1 + 2] + img[idx2 + 2]) / 2;
-                    unsigned int color = nearest_color(palette, r, g, b);
-                    out_byte |= (color & 0x03U) << ((3 - i) * 2);
-                }
-                if (fwrite(&out_byte, 1, 1, ofp) != 1) {
-                    fprintf(stderr, "出力ファイルの書き込みに失敗しました\n");
-                    goto out;
-                }
+    if (stream) {
+        int error;
+        if (batch || listname != NULL || opt.animation)
+            usage();
+        if (container != NULL) {
+            if (argc != 1)
+                usage();
+            error = convert_stream(&opt, argv[0], NULL, &frames);
+            if (error == 0)
+                error = write_container(container, &opt, &frames);
+            framelist_free(&frames);
+        } else {
+            if (argc != 2)
+                usage();
+            error = convert_stream(&opt, argv[0], argv[1], NULL);
+        }
+        exit(error == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (container != NULL) {
+        /* 引数は入力画像ファイルのみ */
+        for (i = 0; i < argc; i++)
+            add_job(&jl, argv[i], NULL);
+    } else {
+        if (batch || listname != NULL) {
+            if (argc % 2 != 0)
+                usage();
+        } else {
+            if (argc != 2)
+                usage();
+        }
+        for (i = 0; i < argc; i += 2)
+            add_job(&jl, argv[i], argv[i + 1]);
+    }
+    if (listname != NULL &&
+      read_manifest(&jl, listname, container == NULL) != 0)
+        exit(EXIT_FAILURE);
+    if (jl.njobs == 0)
+        usage();
+    {
+        /*
+         * 標準入力は1度しか読めず (リストファイルに使った場合も含む)、
+         * 各ファイルは終わった順に書き出すので、標準入力・標準出力を
+         * 使えるのはそれぞれ1ファイルだけ
+         */
+        size_t nstdin = 0, nstdout = 0;
+
+        if (listname != NULL && strcmp(listname, "-") == 0)
+            nstdin++;
+        for (j = 0; j < jl.njobs; j++) {
+            if (strcmp(jl.jobs[j].ifname, "-") == 0)
+                nstdin++;
+            if (jl.jobs[j].ofname != NULL &&
+              strcmp(jl.jobs[j].ofname, "-") == 0)
+                nstdout++;
+        }
+        if (nstdin > 1) {
+            fprintf(stderr, "標準入力 (-) から読めるのは1ファイル (またはリストファイル) だけです\n");
+            exit(EXIT_FAILURE);
+        }
+        if (nstdout > 1) {
+            fprintf(stderr, "標準出力 (-) に出力できるのは1ファイルだけです\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opt.animation && container == NULL) {
+        /* フレームごとのファイル名を作れるか先に調べておく */
+        for (j = 0; j < jl.njobs; j++) {
+            if (check_frame_pattern(jl.jobs[j].ofname) != 0) {
+                fprintf(stderr, "-a の出力ファイル名にはフレーム番号を埋め込む %%d を1つだけ含めてください: %s\n",
+                  jl.jobs[j].ofname);
+                exit(EXIT_FAILURE);
             }
         }
-    } else if (mode == 4) {
-        /* 1バイトあたり8ドット */
-        img_stride = ((img_xsize + 7) / 8);
-        for (y = 0; y < img_ysize; y++) {
-            for (x_byte = 0; x_byte < img_stride; x_byte++) {
-                uint8_t out_byte = 0;
-                int bit;
-                for (bit = 0; bit < 8; bit++) {
-                    int x = x_byte * 8 + bit;
-                    int idx = (y * img_xsize + x) * 3;
-                    uint8_t r = img[idx + 0];
-                    uint8_t g = img[idx + 1];
-                    uint8_t b = img[idx + 2];
-                    uint8_t gray = rgb_to_gray(r, g, b);
-                    if (gray > 127) {
-                        out_byte |= 0x80U >> bit; 
+    }
+
+    /*
+     * 重いデコードの前にヘッダだけで変換できないファイルを洗い出す
+     * コンテナは1ファイルでも失敗したら作らないので、その場合は変換もしない
+     */
+    if (preflight(&opt, &jl) == 0 || container == NULL)
+        convert_all(&opt, &jl, nthreads);
+
+    nfailed = 0;
+    for (j = 0; j < jl.njobs; j++) {
+        if (jl.jobs[j].failed)
+            nfailed++;
+    }
+
+    if (container != NULL) {
+        /* 1ファイルでも失敗したらフレーム番号がずれるのでコンテナは作らない */
+        if (nfailed == 0) {
+            /* 差分符号化はここで入力順に行う（それ以外は符号化済み） */
+            encoder_t *enc = malloc(sizeof(*enc));
+            if (enc == NULL) {
+                fprintf(stderr, "メモリが足りません\n");
+                exit(EXIT_FAILURE);
+            }
+            encoder_init(enc, &opt);
+            if (opt.encoding != ENC_DELTA)
+                enc->method = ENC_RAW;
+            for (j = 0; j < jl.njobs && nfailed == 0; j++) {
+                const framelist_t *jf = &jl.jobs[j].frames;
+                size_t f, size, outsize;
+                for (f = 0; f < jf->nframes; f++) {
+                    const uint8_t *data = framelist_frame(jf, f, &size);
+                    const uint8_t *out;
+                    if (encode_frame(enc, jl.jobs[j].ifname, data, size,
+                      &out, &outsize) != 0) {
+                        jl.jobs[j].failed = 1;
+                        nfailed++;
+                        break;
+                    }
+                    if (framelist_add(&frames, out, outsize,
+                      jf->delays[f]) != 0) {
+                        fprintf(stderr, "メモリが足りません\n");
+                        exit(EXIT_FAILURE);
                     }
-                }
-                if (fwrite(&out_byte, 1, 1, ofp) != 1) {
-                    fprintf(stderr, "出力ファイルの書き込みに失敗しました\n");
-                    goto out;
                 }
             }
+            free(enc);
+            if (nfailed == 0 &&
+              write_container(container, &opt, &frames) != 0)
+                nfailed = jl.njobs;
+            framelist_free(&frames);
+        } else {
+            fprintf(stderr, "コンテナ %s は作成しませんでした\n", container);
         }
     }
-    status = EXIT_SUCCESS;
 
- out:
-    if (ofp != NULL)
-        fclose(ofp);
-    if (img != NULL)
-        stbi_image_free(img);
-    exit(status);
+    if (nfailed > 0 && jl.njobs > 1) {
+        fprintf(stderr, "%zu/%zu ファイルの変換に失敗しました:\n",
+          nfailed, jl.njobs);
+        for (j = 0; j < jl.njobs; j++) {
+            if (jl.jobs[j].failed)
+                fprintf(stderr, "  %s\n", jl.jobs[j].ifname);
+        }
+    }
+
+    for (j = 0; j < jl.njobs; j++) {
+        free(jl.jobs[j].ifname);
+        free(jl.jobs[j].ofname);
+        framelist_free(&jl.jobs[j].frames);
+    }
+    free(jl.jobs);
+    exit(nfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }